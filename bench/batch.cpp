@@ -0,0 +1,78 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "kaleidoscope.hpp"
+
+using namespace std;
+
+namespace
+{
+const char *Source = R"(
+def price(spot strike rate) spot*1.05 - strike*(1 - rate*0.25) + rate*rate*0.5;
+)";
+
+template <typename F>
+double time(F f)
+{
+    auto start = chrono::steady_clock::now();
+    f();
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+} // namespace
+
+// batch <rows> <threads> - print one JSON object with the evaluations per
+// second of a scalar call loop and of the batch function
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s <rows> <threads>\n", argv[0]);
+        return 1;
+    }
+    size_t rows = strtoull(argv[1], nullptr, 10);
+    unsigned threads = strtoul(argv[2], nullptr, 10);
+
+    kaleidoscope::Session session(true);
+    if (!session.compile(Source))
+    {
+        fprintf(stderr, "%s", session.errors().c_str());
+        return 1;
+    }
+    auto scalar = (double (*)(double, double, double))session.lookup("price");
+    auto batch = session.lookup_batch("price");
+
+    vector<double> spot(rows), strike(rows), rate(rows), out(rows);
+    for (size_t i = 0; i < rows; ++i)
+    {
+        spot[i] = 100 + i % 50;
+        strike[i] = 90 + i % 30;
+        rate[i] = (i % 10) * 0.01;
+    }
+    const double *columns[] = { spot.data(), strike.data(), rate.data() };
+
+    auto scalar_seconds = time([&]
+    {
+        for (size_t i = 0; i < rows; ++i)
+        {
+            out[i] = scalar(spot[i], strike[i], rate[i]);
+        }
+    });
+    auto check = out[rows / 2];
+
+    auto batch_seconds = time([&]
+    {
+        kaleidoscope::Session::evaluate_batch(batch, columns, out.data(), rows, threads);
+    });
+    if (out[rows / 2] != check)
+    {
+        fprintf(stderr, "batch result differs from the scalar call\n");
+        return 1;
+    }
+
+    printf("{\"rows\":%zu,\"threads\":%u,\"scalar evaluations per second\":%.0f,"
+           "\"batch evaluations per second\":%.0f}\n",
+           rows, threads, rows / scalar_seconds, rows / batch_seconds);
+    return 0;
+}
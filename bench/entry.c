@@ -0,0 +1,11 @@
+#include <stdio.h>
+
+double __anno_expr(void);
+
+/* main - print the value of the last top-level expression of a program
+ * compiled with -c, as the REPL would */
+int main(void)
+{
+    printf("%.17g\n", __anno_expr());
+    return 0;
+}
@@ -0,0 +1,185 @@
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace std;
+
+namespace
+{
+// functions - n definitions, each calling the previous one
+void gen_functions(size_t n)
+{
+    printf("def f0(x y) x + y;\n");
+    for (size_t i = 1; i < n; ++i)
+    {
+        printf("def f%zu(x y) x*%zu + y - f%zu(y, x);\n", i, i, i - 1);
+    }
+    printf("f%zu(1, 2);\n", n - 1);
+}
+
+// expressions - one function whose body is an expression of n terms, the
+// first ones opening parentheses nested up to 32 deep
+void gen_expressions(size_t n)
+{
+    printf("def deep(x y)\n    ");
+    size_t open = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (i)
+        {
+            printf(i % 3 ? " + " : " - ");
+        }
+        if (i % 4 == 0 && open < 32)
+        {
+            printf("(");
+            ++open;
+        }
+        printf("x*%zu.5 - y*%zu", i, i % 7);
+    }
+    for (; open; --open)
+    {
+        printf(")");
+    }
+    printf(";\ndeep(1, 2);\n");
+}
+
+// operators - every available symbol becomes a binary operator with its own
+// precedence, then n functions combine all of them
+void gen_operators(size_t n)
+{
+    const string symbols = "!$%&^|~?@/>{}[]'`\\";
+    for (size_t i = 0; i < symbols.size(); ++i)
+    {
+        printf("def binary%c %zu (a b) a*%zu + b;\n", symbols[i], 3 + i * 5, i + 1);
+    }
+    for (size_t i = 0; i < n; ++i)
+    {
+        printf("def op%zu(x y) x", i);
+        for (size_t j = 0; j < symbols.size(); ++j)
+        {
+            printf(" %c %s", symbols[(i + j) % symbols.size()], j % 2 ? "x" : "y");
+        }
+        printf(";\n");
+    }
+    printf("op%zu(1, 2);\n", n - 1);
+}
+
+// loops - a nested loop running n iterations of the inner body in total
+void gen_loops(size_t n)
+{
+    printf("def binary : 1 (x y) y;\n");
+    printf("def loops(n m)\n"
+           "    var s = 0 in\n"
+           "        (for i = 0, i < n in\n"
+           "            for j = 0, j < m in s = s + i*0.5 - j*0.25) : s;\n");
+    printf("loops(%zu, 1000);\n", n / 1000 + 1);
+}
+// lookups - n independent definitions followed by 1000 top-level calls,
+// each of which makes the JIT resolve symbols among all n definitions
+void gen_lookups(size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        printf("def g%zu(x) x + %zu;\n", i, i);
+    }
+    for (size_t i = 0; i < 1000; ++i)
+    {
+        printf("g%zu(%zu);\n", i * 7919 % n, i);
+    }
+}
+// session - n small top-level expressions, each compiled and run on its own
+void gen_session(size_t n)
+{
+    printf("def sq(x) x*x;\n");
+    for (size_t i = 0; i < n; ++i)
+    {
+        printf("sq(%zu) + %zu;\n", i % 1000, i);
+    }
+}
+// redefine - n callers of one function, all linked before the function is
+// redefined and called through again
+void gen_redefine(size_t n)
+{
+    printf("def target(x) x;\n");
+    for (size_t i = 0; i < n; ++i)
+    {
+        printf("def c%zu(x) target(x) + %zu;\n", i, i);
+    }
+    for (size_t i = 0; i < n; ++i)
+    {
+        printf("c%zu(1);\n", i);
+    }
+    printf("def target(x) x*2;\n");
+    for (size_t i = 0; i < n; ++i)
+    {
+        printf("c%zu(1);\n", i);
+    }
+}
+// script - n definitions, each followed by an expression that calls it and
+// takes about as long to run as the definition takes to compile
+void gen_script(size_t n)
+{
+    printf("def fib(x) if x < 3 then 1 else fib(x-1) + fib(x-2);\n");
+    for (size_t i = 0; i < n; ++i)
+    {
+        printf("def s%zu(x y) fib(x) * %zu + y;\n", i, i);
+        printf("s%zu(%zu, %zu);\n", i, 20 + i % 5, i);
+    }
+}
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s functions|expressions|operators|loops|lookups|session|redefine|script <n>\n", argv[0]);
+        return 1;
+    }
+
+    string kind = argv[1];
+    size_t n = strtoull(argv[2], nullptr, 10);
+    if (n == 0)
+    {
+        fprintf(stderr, "<n> must be positive\n");
+        return 1;
+    }
+
+    if (kind == "functions")
+    {
+        gen_functions(n);
+    }
+    else if (kind == "expressions")
+    {
+        gen_expressions(n);
+    }
+    else if (kind == "operators")
+    {
+        gen_operators(n);
+    }
+    else if (kind == "loops")
+    {
+        gen_loops(n);
+    }
+    else if (kind == "lookups")
+    {
+        gen_lookups(n);
+    }
+    else if (kind == "session")
+    {
+        gen_session(n);
+    }
+    else if (kind == "redefine")
+    {
+        gen_redefine(n);
+    }
+    else if (kind == "script")
+    {
+        gen_script(n);
+    }
+    else
+    {
+        fprintf(stderr, "unknown program kind: %s\n", kind.c_str());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,12 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+double run(double n);
+
+/* main [n] - print the result of run(n) as a JSON object */
+int main(int argc, char *argv[])
+{
+    double n = argc > 1 ? atof(argv[1]) : 1e8;
+    printf("{\"n\":%.0f,\"result\":%.17g}\n", n, run(n));
+    return 0;
+}
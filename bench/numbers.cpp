@@ -0,0 +1,90 @@
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdlib>
+
+#include "number.hpp"
+
+using namespace std;
+
+namespace
+{
+template <typename F>
+double time(F f)
+{
+    auto start = chrono::steady_clock::now();
+    f();
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+} // namespace
+
+// numbers <n> - print one JSON object with the literals parsed and numbers
+// formatted per second by stod and printf("%f") against parse_number and
+// format_number
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s <n>\n", argv[0]);
+        return 1;
+    }
+    size_t n = strtoull(argv[1], nullptr, 10);
+
+    // literals as the lexer sees them: integers and decimals of various
+    // lengths
+    mt19937_64 random(42);
+    vector<double> values(n);
+    vector<string> literals(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        values[i] = (double)(random() % 100000000) / (1 << (random() % 20));
+        char text[64];
+        snprintf(text, sizeof(text), "%.*f", (int)(random() % 10), values[i]);
+        literals[i] = text;
+    }
+
+    vector<double> by_stod(n), by_parse(n);
+    auto stod_seconds = time([&]
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            by_stod[i] = stod(literals[i]);
+        }
+    });
+    auto parse_seconds = time([&]
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            kaleidoscope::parse_number(literals[i], by_parse[i]);
+        }
+    });
+    if (by_stod != by_parse)
+    {
+        fprintf(stderr, "parse_number differs from stod\n");
+        return 1;
+    }
+
+    size_t length = 0;
+    char text[kaleidoscope::MaxNumberLength + 320];
+    auto printf_seconds = time([&]
+    {
+        for (auto value : values)
+        {
+            length += snprintf(text, sizeof(text), "%f", value);
+        }
+    });
+    auto format_seconds = time([&]
+    {
+        for (auto value : values)
+        {
+            length += kaleidoscope::format_number(text, value) - text;
+        }
+    });
+
+    printf("{\"numbers\":%zu,\"stod per second\":%.0f,\"parse_number per second\":%.0f,"
+           "\"printf per second\":%.0f,\"format_number per second\":%.0f,\"bytes\":%zu}\n",
+           n, n / stod_seconds, n / parse_seconds, n / printf_seconds, n / format_seconds, length);
+    return 0;
+}
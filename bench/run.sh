@@ -0,0 +1,298 @@
+#!/bin/sh
+# run.sh - run the benchmark suite, appending one JSON record per run to the
+# results file so that runs can be compared across revisions
+#
+# usage: run.sh <bin> [results]
+#
+# <bin> holds kaleidoscope and the benchmark programs built by make bench
+#
+# SESSION sets the number of expressions in the long REPL session benchmark
+#
+# The output of every run is compared with that of the first run of the same
+# benchmark, which takes the serial default path; the script fails at the end
+# if any differ.
+
+set -e
+
+BIN=$1
+KALEIDOSCOPE=$BIN/kaleidoscope
+GENERATE=$BIN/generate
+RESULTS=${2:-bench/results.jsonl}
+KERNELS=$(dirname "$0")/kernels
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+REVISION=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+DATE=$(date -u +%Y-%m-%dT%H:%M:%SZ)
+
+# normalize - output of a run without the REPL's banner and prompts
+normalize()
+{
+    awk 'NR == 1 && /^ _ / { banner = 1 }
+         banner { if (/^See more on/) { banner = 0; getline }; next }
+         { line = $0; if (gsub(/ready> /, "", line) && line == "") next; print line }'
+}
+
+# check_output <benchmark> <config> - compare $WORK/stdout with the output
+# of the first run of the benchmark, setting $output to the result
+MISMATCHES=
+CHECK_OUTPUT=1
+check_output()
+{
+    expected="$WORK/expected-$1"
+    if [ "$CHECK_OUTPUT" = 0 ]; then
+        output=unchecked
+    elif [ ! -f "$expected" ]; then
+        normalize < "$WORK/stdout" > "$expected"
+        output=reference
+    elif normalize < "$WORK/stdout" | cmp -s - "$expected"; then
+        output=matches
+    else
+        output=differs
+        MISMATCHES="$MISMATCHES $1/$2"
+    fi
+}
+
+# run <benchmark> <config> <input> [options...]
+run()
+{
+    benchmark=$1
+    config=$2
+    input=$3
+    shift 3
+
+    # inputs with errors make the compiler fail, which is recorded too
+    status=0
+    start=$(date +%s.%N)
+    "$KALEIDOSCOPE" --stats-json "$@" < "$input" > "$WORK/stdout" 2> "$WORK/stderr" || status=$?
+    end=$(date +%s.%N)
+
+    wall=$(awk "BEGIN { printf \"%.6f\", $end - $start }")
+    stats=$(grep -o '{"timers".*' "$WORK/stderr" | tail -n 1)
+    check_output "$benchmark" "$config"
+
+    printf '{"revision":"%s","date":"%s","benchmark":"%s","config":"%s","wall seconds":%s,"exit status":%d,"output":"%s","stats":%s}\n' \
+        "$REVISION" "$DATE" "$benchmark" "$config" "$wall" "$status" "$output" "${stats:-null}" >> "$RESULTS"
+    printf '%-24s %-20s %10s s  %s\n' "$benchmark" "$config" "$wall" "$output"
+}
+
+# check_entry <benchmark> <config> <object> - link an object or archive
+# compiled with -c and check the value of its last top-level expression
+check_entry()
+{
+    cc "$(dirname "$0")/entry.c" "$3" -o "$WORK/entry"
+    "$WORK/entry" > "$WORK/stdout"
+    check_output "$1" "$2"
+    printf '%-24s %-20s %12s  %s\n' "$1" "$2" "" "$output"
+}
+
+# run_program <benchmark> <config> <program> [arguments...]
+# for benchmark programs printing their own JSON statistics
+run_program()
+{
+    benchmark=$1
+    config=$2
+    shift 2
+
+    start=$(date +%s.%N)
+    stats=$("$@")
+    end=$(date +%s.%N)
+
+    wall=$(awk "BEGIN { printf \"%.6f\", $end - $start }")
+    printf '{"revision":"%s","date":"%s","benchmark":"%s","config":"%s","wall seconds":%s,"stats":%s}\n' \
+        "$REVISION" "$DATE" "$benchmark" "$config" "$wall" "${stats:-null}" >> "$RESULTS"
+    printf '%-24s %-20s %10s s\n' "$benchmark" "$config" "$wall"
+}
+
+# compile-time scaling on generated programs
+for kind in functions expressions operators loops; do
+    for n in 1000 10000; do
+        "$GENERATE" $kind $n > "$WORK/$kind.ks"
+        run "$kind-$n" O2 "$WORK/$kind.ks"
+    done
+done
+
+# peak RSS of -c against input size, one module against objects of 1000
+# definitions written as they are compiled
+for n in 20000 200000; do
+    "$GENERATE" functions $n > "$WORK/stream.ks"
+    run stream-$n one-module "$WORK/stream.ks" -c "$WORK/stream.ks" -o "$WORK/stream.o"
+    run stream-$n stream-1000 "$WORK/stream.ks" -c "$WORK/stream.ks" -o "$WORK/stream.a" --stream 1000
+done
+
+# the last top-level expression of a program, against the one module of -c:
+# with every definition in an object of its own, so that the expression
+# lands in an earlier one, and for a larger program compiled on 4 threads
+for n in 2000 20000; do
+    "$GENERATE" script $n > "$WORK/entry-$n.ks"
+    echo 'def unused(x) x;' >> "$WORK/entry-$n.ks"
+    "$KALEIDOSCOPE" -c "$WORK/entry-$n.ks" -o "$WORK/entry.o"
+    check_entry entry-$n one-module "$WORK/entry.o"
+done
+"$KALEIDOSCOPE" -c "$WORK/entry-2000.ks" -o "$WORK/entry.a" --stream 1
+check_entry entry-2000 stream-1 "$WORK/entry.a"
+"$KALEIDOSCOPE" -c "$WORK/entry-20000.ks" -o "$WORK/entry.o" --jobs 4
+check_entry entry-20000 jobs-4 "$WORK/entry.o"
+
+# -c on a 100 MB source on 1 to 8 threads, written as unoptimized bitcode
+# so that the time goes to parsing and code generation
+"$GENERATE" operators 1100000 > "$WORK/large.ks"
+for jobs in 1 2 4 8; do
+    run large-100mb jobs-$jobs /dev/null -c "$WORK/large.ks" -o "$WORK/large.bc" --emit bc --opt-level O0 --jobs $jobs
+done
+rm -f "$WORK/large.ks" "$WORK/large.bc"
+
+# -c on 200000 definitions with a stray ')' in every 1000th: giving up after
+# the default 20 errors, and recovering from every one of them
+"$GENERATE" functions 200000 | sed '/^def f[0-9]*000(/s/x\*/x*)/' > "$WORK/errors.ks"
+run errors-200000 max-errors-20 "$WORK/errors.ks" -c "$WORK/errors.ks" -o "$WORK/errors.o"
+run errors-200000 no-limit "$WORK/errors.ks" -c "$WORK/errors.ks" -o "$WORK/errors.o" --max-errors 0
+
+# JIT symbol lookup latency with a large number of live definitions
+"$GENERATE" lookups 10000 > "$WORK/lookups.ks"
+run lookups-10000 O2 "$WORK/lookups.ks"
+
+# warm start: a session with thousands of definitions rebuilt from source,
+# then restored from its image before running the same top-level calls
+"$GENERATE" lookups 5000 > "$WORK/image.ks"
+grep -v '^def' "$WORK/image.ks" > "$WORK/image-calls.ks"
+run image-5000 cold "$WORK/image.ks"
+run image-5000 save "$WORK/image.ks" --save-session "$WORK/session.img"
+run image-5000 warm "$WORK/image-calls.ks" --load-session "$WORK/session.img"
+
+# startup with a shared library of 2000 definitions, compiled from source on
+# every run or precompiled once and loaded with --prelude
+"$GENERATE" functions 2000 | grep '^def' > "$WORK/prelude.ks"
+echo 'f1999(1, 2);' > "$WORK/prelude-main.ks"
+cat "$WORK/prelude.ks" "$WORK/prelude-main.ks" > "$WORK/prelude-source.ks"
+"$KALEIDOSCOPE" -c "$WORK/prelude.ks" --library -o "$WORK/prelude.o"
+run prelude-2000 source "$WORK/prelude-source.ks"
+run prelude-2000 precompiled "$WORK/prelude-main.ks" --prelude "$WORK/prelude.o"
+
+# separate compilation of a 500-file project: full build, no-op rebuild,
+# and rebuild after changing the body of one function
+mkdir "$WORK/project"
+for i in $(seq 0 499); do
+    {
+        printf 'def p%d(x) x + %d;\n' $i $i
+        [ $i -gt 0 ] && printf 'def q%d(x) p%d(x) * p%d(x);\n' $i $((i - 1)) $i
+        true
+    } > "$WORK/project/unit$i.ks"
+done
+run project-500 full-build /dev/null --build "$WORK/project"
+run project-500 no-op /dev/null --build "$WORK/project"
+printf 'def p250(x) x - 250;\n' > "$WORK/project/unit250.ks"
+printf 'def q250(x) p249(x) * p250(x);\n' >> "$WORK/project/unit250.ks"
+run project-500 one-change /dev/null --build "$WORK/project"
+
+# a long-running session re-submitting a 5000-function source with one
+# function changed, against submitting it once
+"$GENERATE" functions 5000 > "$WORK/resubmit.ks"
+sed 's/^def f2500(x y) x\*2500 /def f2500(x y) x*2501 /' "$WORK/resubmit.ks" > "$WORK/resubmit-changed.ks"
+cat "$WORK/resubmit.ks" "$WORK/resubmit-changed.ks" > "$WORK/resubmit-twice.ks"
+# the outputs differ by design here, and below
+CHECK_OUTPUT=0
+run resubmit-5000 once "$WORK/resubmit.ks"
+run resubmit-5000 one-change "$WORK/resubmit-twice.ks"
+
+# redefining a function with 1000 compiled callers, through stubs and with
+# direct calls
+"$GENERATE" redefine 1000 > "$WORK/redefine.ks"
+run redefine-1000 indirection "$WORK/redefine.ks"
+run redefine-1000 no-indirection "$WORK/redefine.ks" --no-indirection
+CHECK_OUTPUT=1
+
+# a piped script run item by item and through the pipelined driver
+"$GENERATE" script 2000 > "$WORK/script.ks"
+run script-2000 serial "$WORK/script.ks"
+run script-2000 pipeline "$WORK/script.ks" --pipeline
+
+# JIT memory and per-expression latency over a long REPL session
+SESSION=${SESSION:-100000}
+"$GENERATE" session $SESSION > "$WORK/session.ks"
+run session-$SESSION O2 "$WORK/session.ks"
+
+# runtime kernels across the optimization presets, the default first
+for kernel in fib mandelbrot integrate sum nested; do
+    for level in O2 O0 O1 O3 Os; do
+        run $kernel $level "$KERNELS/$kernel.ks" --opt-level $level
+    done
+done
+
+# the counted loops of the kernels against the same loops started from a
+# value that isn't a constant, which are compiled as generic loops
+for kernel in sum nested; do
+    sed 's/for \([a-z]*\) = \([0-9]*\),/for \1 = \2 + 0 * n,/' "$KERNELS/$kernel.ks" > "$WORK/$kernel-generic.ks"
+    run $kernel generic-loops "$WORK/$kernel-generic.ks"
+done
+
+# printing 10M numbers: unbuffered stdio, the buffered runtime and its bulk
+# variant
+export KALEIDOSCOPE_UNBUFFERED=1
+run print-10000000 unbuffered "$KERNELS/print.ks"
+unset KALEIDOSCOPE_UNBUFFERED
+run print-10000000 buffered "$KERNELS/print.ks"
+run print-10000000 bulk "$KERNELS/printbulk.ks"
+
+# memoization of pure recursive functions
+run fib memoize "$KERNELS/fib.ks" --memoize
+
+# a generic loop nest called with constant bounds and mode, compiled as is
+# and specialized for the constants
+run grid default "$KERNELS/grid.ks"
+run grid specialize "$KERNELS/grid.ks" --specialize
+
+# profile-guided optimization: train, then rebuild with the profile
+for kernel in fib mandelbrot; do
+    run $kernel profile-generate "$KERNELS/$kernel.ks" --profile-generate "$WORK/$kernel.prof"
+    run $kernel profile-use "$KERNELS/$kernel.ks" --profile-use "$WORK/$kernel.prof"
+done
+
+# parfor reduction over the rows of a grid, on 1 to 8 workers
+for threads in 1 2 4 8; do
+    export KALEIDOSCOPE_THREADS=$threads
+    run mandelrows threads-$threads "$KERNELS/mandelrows.ks"
+done
+unset KALEIDOSCOPE_THREADS
+
+# a program split over three files calling each other in its inner loop:
+# per-file objects against the files compiled as one with --lto, and
+# against bitcode linked with link-time optimization
+LTO=$(dirname "$0")/lto
+for unit in vec step run; do
+    "$KALEIDOSCOPE" -c "$LTO/$unit.ks" -o "$WORK/$unit.o"
+done
+cc -O2 "$LTO/main.c" "$WORK/vec.o" "$WORK/step.o" "$WORK/run.o" -o "$WORK/lto-objects"
+run_program lto-100000000 objects "$WORK/lto-objects" 100000000
+
+"$KALEIDOSCOPE" --lto "$LTO/vec.ks,$LTO/step.ks,$LTO/run.ks" --export run -o "$WORK/program.o"
+cc -O2 "$LTO/main.c" "$WORK/program.o" -o "$WORK/lto-whole-program"
+run_program lto-100000000 whole-program "$WORK/lto-whole-program" 100000000
+
+if command -v clang > /dev/null; then
+    for unit in vec step run; do
+        "$KALEIDOSCOPE" -c "$LTO/$unit.ks" --emit bc -o "$WORK/$unit.bc"
+    done
+    clang -O2 -flto -fuse-ld=lld "$LTO/main.c" "$WORK/vec.bc" "$WORK/step.bc" "$WORK/run.bc" -o "$WORK/lto-bitcode"
+    run_program lto-100000000 bitcode "$WORK/lto-bitcode" 100000000
+fi
+
+# throughput of embedded sessions compiling and evaluating in parallel
+for threads in 1 2 4 8; do
+    run_program sessions-64 threads-$threads "$BIN/sessions" $threads 64 200
+done
+
+# number literal parsing and formatting throughput
+run_program numbers-10000000 default "$BIN/numbers" 10000000
+
+# batch functions against a scalar call loop, on 1 to 8 threads
+for threads in 1 2 4 8; do
+    run_program batch-10000000 threads-$threads "$BIN/batch" 10000000 $threads
+done
+
+echo "results appended to $RESULTS"
+if [ -n "$MISMATCHES" ]; then
+    echo "output differs from the first run of the benchmark:$MISMATCHES" >&2
+    exit 1
+fi
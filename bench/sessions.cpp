@@ -0,0 +1,82 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "kaleidoscope.hpp"
+
+using namespace std;
+
+namespace
+{
+const char *Source = R"(
+def binary : 1 (x y) y;
+def fib(x) if x < 3 then 1 else fib(x-1) + fib(x-2);
+def poly(x) x*x*x - 2*x*x + 3*x - 4;
+def sum(n) var s = 0 in (for i = 0, i < n in s = s + poly(i)) : s;
+)";
+
+// session - compile the source in a fresh session, then evaluate n
+// expressions and call the compiled fib directly
+void session(size_t n)
+{
+    kaleidoscope::Session s;
+    if (!s.compile(Source))
+    {
+        fprintf(stderr, "%s", s.errors().c_str());
+        exit(1);
+    }
+    for (size_t i = 0; i < n; ++i)
+    {
+        s.evaluate("sum(" + to_string(i % 100) + ") + fib(" + to_string(i % 15) + ");");
+    }
+    auto fib = (double (*)(double))s.lookup("fib");
+    if (!fib || fib(20) != 6765)
+    {
+        fprintf(stderr, "fib failed\n");
+        exit(1);
+    }
+}
+} // namespace
+
+// sessions <threads> <sessions> <evaluations per session> - print one JSON
+// object with the throughput of the threads running all the sessions
+int main(int argc, char *argv[])
+{
+    if (argc != 4)
+    {
+        fprintf(stderr, "usage: %s <threads> <sessions> <evaluations per session>\n", argv[0]);
+        return 1;
+    }
+    size_t num_threads = strtoull(argv[1], nullptr, 10);
+    size_t num_sessions = strtoull(argv[2], nullptr, 10);
+    size_t num_evaluations = strtoull(argv[3], nullptr, 10);
+
+    atomic<size_t> next(0);
+    auto start = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (size_t i = 0; i < num_threads; ++i)
+    {
+        threads.emplace_back([&]
+        {
+            while (next++ < num_sessions)
+            {
+                session(num_evaluations);
+            }
+        });
+    }
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    auto seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    printf("{\"threads\":%zu,\"sessions\":%zu,\"evaluations\":%zu,\"seconds\":%.6f,"
+           "\"sessions per second\":%.3f,\"evaluations per second\":%.3f}\n",
+           num_threads, num_sessions, num_sessions * num_evaluations, seconds,
+           num_sessions / seconds, num_sessions * num_evaluations / seconds);
+    return 0;
+}
@@ -13,19 +13,25 @@
 #ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
+#include "stats.hpp"
+#include "PooledMemoryManager.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/iterator_range.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
 #include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
-#include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Mangler.h"
 #include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
 #include <algorithm>
@@ -37,38 +43,147 @@
 namespace llvm {
 namespace orc {
 
+// SimpleCompiler that records the time spent in the backend.
+class TimedCompiler {
+public:
+  TimedCompiler(TargetMachine &TM) : Compiler(TM) {}
+
+  SimpleCompiler::CompileResult operator()(Module &M) {
+    kaleidoscope::ScopedTimer Timer(kaleidoscope::JITCompileTime);
+    return Compiler(M);
+  }
+
+private:
+  SimpleCompiler Compiler;
+};
+
 class KaleidoscopeJIT {
 public:
   using ObjLayerT = LegacyRTDyldObjectLinkingLayer;
-  using CompileLayerT = LegacyIRCompileLayer<ObjLayerT, SimpleCompiler>;
+  using CompileLayerT = LegacyIRCompileLayer<ObjLayerT, TimedCompiler>;
 
-  KaleidoscopeJIT()
+  // With UseIndirection, calls between modules go through a stub per
+  // function, so that redefining a function retargets every existing caller
+  // without recompiling it. Without it, calls bind directly to whichever
+  // definition was newest when the caller was linked.
+  //
+  // With ConcurrentExecution, JIT'd code may run on another thread while new
+  // modules are linked. Only functions that are not being redefined may run
+  // meanwhile.
+  KaleidoscopeJIT(bool UseIndirection = true, bool ConcurrentExecution = false)
       : Resolver(createLegacyLookupResolver(
             ES,
             [this](const std::string &Name) { return findMangledSymbol(Name); },
             [](Error Err) { cantFail(std::move(Err), "lookupFlags failed"); })),
         TM(EngineBuilder().selectTarget()), DL(TM->createDataLayout()),
+        Pool(std::make_shared<MemoryPool>(ConcurrentExecution)),
         ObjectLayer(ES,
                     [this](VModuleKey) {
                       return ObjLayerT::Resources{
-                          std::make_shared<SectionMemoryManager>(), Resolver};
+                          std::make_shared<PooledMemoryManager>(Pool),
+                          Resolver};
+                    },
+                    [this](VModuleKey K, const object::ObjectFile &Obj,
+                           const RuntimeDyld::LoadedObjectInfo &) {
+                      kaleidoscope::JITObjectBytes.add(Obj.getData().size());
+                      if (RecordObjects)
+                        Objects[K] = Obj.getData().str();
                     }),
         CompileLayer(ObjectLayer,
-                     SimpleCompiler(*TM)) {
+                     TimedCompiler(*TM)) {
     llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+    if (UseIndirection)
+      StubsMgr = createLocalIndirectStubsManagerBuilder(TM->getTargetTriple())();
   }
 
   TargetMachine &getTargetMachine() { return *TM; }
 
+  bool usesIndirection() const { return StubsMgr != nullptr; }
+
   VModuleKey addModule(std::unique_ptr<Module> M) {
     auto K = ES.allocateVModule();
+
+    // Move each function body aside to Name$impl and let Name be its stub.
+    // Calls within the module still go to the body directly. A top-level
+    // expression is only run through the module that defines it, so it gets
+    // no stub that the next expression would retarget.
+    std::vector<std::string> Redirected;
+    if (StubsMgr)
+      for (auto &F : M->functions()) {
+        if (F.isDeclaration() || F.hasLocalLinkage() ||
+            F.getName() == "__anno_expr")
+          continue;
+        Redirected.push_back(mangle(F.getName().str()));
+        F.setName(F.getName() + ImplSuffix);
+      }
+
+    std::vector<std::string> Names;
+    for (auto &GV : M->global_values())
+      if (!GV.isDeclaration() && !GV.hasLocalLinkage())
+        Names.push_back(mangle(GV.getName().str()));
+
     cantFail(CompileLayer.addModule(K, std::move(M)));
-    ModuleKeys.push_back(K);
+    addSymbols(K, std::move(Names), Redirected);
+    return K;
+  }
+
+  // Adds an object compiled by an earlier session, given the mangled names
+  // of the symbols it defines as returned by getObjects.
+  VModuleKey addObject(std::unique_ptr<MemoryBuffer> Obj,
+                       std::vector<std::string> Names) {
+    auto K = ES.allocateVModule();
+    std::vector<std::string> Redirected;
+    for (StringRef Name : Names)
+      if (Name.consume_back(ImplSuffix))
+        Redirected.push_back(Name.str());
+
+    cantFail(ObjectLayer.addObject(K, std::move(Obj)));
+    addSymbols(K, std::move(Names), Redirected);
     return K;
   }
 
+  // Keeps a copy of the object code of every module linked from now on.
+  void recordObjects() { RecordObjects = true; }
+
+  // Returns the recorded object code of every module still loaded, oldest
+  // first, along with the mangled names of the symbols it defines.
+  std::vector<std::pair<std::vector<std::string>, StringRef>> getObjects() {
+    std::vector<VModuleKey> Keys;
+    for (auto &KV : ModuleSymbols)
+      Keys.push_back(KV.first);
+    std::sort(Keys.begin(), Keys.end());
+
+    std::vector<std::pair<std::vector<std::string>, StringRef>> Result;
+    for (auto K : Keys) {
+      auto &Names = ModuleSymbols[K];
+      if (Names.empty())
+        continue;
+      // Objects are only linked, and so recorded, on their first lookup.
+      cantFail(CompileLayer.findSymbolIn(K, Names.front(), ExportedSymbolsOnly)
+                   .getAddress());
+      auto I = Objects.find(K);
+      if (I != Objects.end())
+        Result.push_back({Names, I->second});
+    }
+    return Result;
+  }
+
   void removeModule(VModuleKey K) {
-    ModuleKeys.erase(find(ModuleKeys, K));
+    auto I = ModuleSymbols.find(K);
+    for (auto &Name : I->second) {
+      StringRef Stub(Name);
+      if (Stub.consume_back(ImplSuffix)) {
+        auto P = PendingStubs.find(Stub);
+        if (P != PendingStubs.end() && P->second == K)
+          PendingStubs.erase(P);
+      }
+      auto Keys = SymbolIndex.find(Name);
+      Keys->second.erase(find(Keys->second, K));
+      if (Keys->second.empty())
+        SymbolIndex.erase(Keys);
+    }
+    ModuleSymbols.erase(I);
+    Objects.erase(K);
     cantFail(CompileLayer.removeModule(K));
   }
 
@@ -76,6 +191,11 @@ public:
     return findMangledSymbol(mangle(Name));
   }
 
+  // Looks Name up in the module K only, whatever newer modules define.
+  JITSymbol findSymbolIn(VModuleKey K, const std::string &Name) {
+    return CompileLayer.findSymbolIn(K, mangle(Name), ExportedSymbolsOnly);
+  }
+
 private:
   std::string mangle(const std::string &Name) {
     std::string MangledName;
@@ -86,30 +206,64 @@ private:
     return MangledName;
   }
 
+  // Indexes the symbols a module defines, so that lookups go straight to the
+  // newest module defining a name, and points the stubs of its functions at
+  // their new bodies.
+  void addSymbols(VModuleKey K, std::vector<std::string> Names,
+                  const std::vector<std::string> &Redirected) {
+    for (auto &Name : Names)
+      SymbolIndex[Name].push_back(K);
+    ModuleSymbols[K] = std::move(Names);
+
+    // An existing stub may already be called from JIT'd code, so retarget it
+    // right away. Other stubs are only created, and their bodies linked,
+    // when they are first looked up.
+    for (auto &Name : Redirected) {
+      if (StubsMgr->findStub(Name, false))
+        cantFail(StubsMgr->updatePointer(Name, getImplAddress(K, Name)));
+      else
+        PendingStubs[Name] = K;
+    }
+  }
+
+  JITTargetAddress getImplAddress(VModuleKey K, const std::string &Name) {
+    return cantFail(
+        CompileLayer.findSymbolIn(K, Name + ImplSuffix, ExportedSymbolsOnly)
+            .getAddress());
+  }
+
   JITSymbol findMangledSymbol(const std::string &Name) {
-#ifdef _WIN32
-    // The symbol lookup of ObjectLinkingLayer uses the SymbolRef::SF_Exported
-    // flag to decide whether a symbol will be visible or not, when we call
-    // IRCompileLayer::findSymbolIn with ExportedSymbolsOnly set to true.
-    //
-    // But for Windows COFF objects, this flag is currently never set.
-    // For a potential solution see: https://reviews.llvm.org/rL258665
-    // For now, we allow non-exported symbols on Windows as a workaround.
-    const bool ExportedSymbolsOnly = false;
-#else
-    const bool ExportedSymbolsOnly = true;
-#endif
+    if (StubsMgr) {
+      auto P = PendingStubs.find(Name);
+      if (P != PendingStubs.end()) {
+        auto K = P->second;
+        PendingStubs.erase(P);
+        cantFail(StubsMgr->createStub(Name, getImplAddress(K, Name),
+                                      JITSymbolFlags::Exported));
+      }
+      if (auto Stub = StubsMgr->findStub(Name, false))
+        return Stub;
+    }
 
-    // Search modules in reverse order: from last added to first added.
-    // This is the opposite of the usual search order for dlsym, but makes more
-    // sense in a REPL where we want to bind to the newest available definition.
-    for (auto H : make_range(ModuleKeys.rbegin(), ModuleKeys.rend()))
-      if (auto Sym = CompileLayer.findSymbolIn(H, Name, ExportedSymbolsOnly))
+    // Bind to the newest module defining the symbol. This is the opposite of
+    // the usual search order for dlsym, but makes more sense in a REPL where
+    // we want to bind to the newest available definition.
+    auto I = SymbolIndex.find(Name);
+    if (I != SymbolIndex.end())
+      if (auto Sym = CompileLayer.findSymbolIn(I->second.back(), Name,
+                                               ExportedSymbolsOnly))
         return Sym;
 
     // If we can't find the symbol in the JIT, try looking in the host process.
-    if (auto SymAddr = RTDyldMemoryManager::getSymbolAddressInProcess(Name))
-      return JITSymbol(SymAddr, JITSymbolFlags::Exported);
+    // Nothing is loaded into the process after startup, so both hits and
+    // misses can be cached.
+    auto P = ProcessSymbols.find(Name);
+    if (P == ProcessSymbols.end())
+      P = ProcessSymbols
+              .insert({Name, RTDyldMemoryManager::getSymbolAddressInProcess(Name)})
+              .first;
+    if (P->second)
+      return JITSymbol(P->second, JITSymbolFlags::Exported);
 
 #ifdef _WIN32
     // For Windows retry without "_" at beginning, as RTDyldMemoryManager uses
@@ -124,13 +278,35 @@ private:
     return nullptr;
   }
 
+#ifdef _WIN32
+  // The symbol lookup of ObjectLinkingLayer uses the SymbolRef::SF_Exported
+  // flag to decide whether a symbol will be visible or not, when we call
+  // IRCompileLayer::findSymbolIn with ExportedSymbolsOnly set to true.
+  //
+  // But for Windows COFF objects, this flag is currently never set.
+  // For a potential solution see: https://reviews.llvm.org/rL258665
+  // For now, we allow non-exported symbols on Windows as a workaround.
+  static constexpr bool ExportedSymbolsOnly = false;
+#else
+  static constexpr bool ExportedSymbolsOnly = true;
+#endif
+
+  static constexpr const char *ImplSuffix = "$impl";
+
   ExecutionSession ES;
   std::shared_ptr<SymbolResolver> Resolver;
   std::unique_ptr<TargetMachine> TM;
   const DataLayout DL;
+  std::shared_ptr<MemoryPool> Pool;
   ObjLayerT ObjectLayer;
   CompileLayerT CompileLayer;
-  std::vector<VModuleKey> ModuleKeys;
+  StringMap<SmallVector<VModuleKey, 1>> SymbolIndex;
+  DenseMap<VModuleKey, std::vector<std::string>> ModuleSymbols;
+  StringMap<JITTargetAddress> ProcessSymbols;
+  std::unique_ptr<IndirectStubsManager> StubsMgr;
+  StringMap<VModuleKey> PendingStubs;
+  bool RecordObjects = false;
+  DenseMap<VModuleKey, std::string> Objects;
 };
 
 } // end namespace orc
@@ -0,0 +1,304 @@
+//===- PooledMemoryManager.h - Slab memory shared by JIT'd objects -*- C++ -*-===//
+//
+// Packs the sections of many small JIT'd objects into shared slabs instead of
+// mapping fresh pages for each of them, recycles the memory of removed
+// objects, and applies page permissions in batches.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_POOLEDMEMORYMANAGER_H
+#define KALEIDOSCOPE_POOLEDMEMORYMANAGER_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/Process.h"
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace llvm {
+namespace orc {
+
+// Slabs of memory shared by all PooledMemoryManagers of a JIT. Each kind of
+// section gets its own slabs, so a page only ever holds one kind and its
+// permissions never conflict.
+//
+// Pages are made writable again when a new allocation lands on them and get
+// their final permissions once no object is being linked any more. This
+// relies on no JIT'd code running while objects are linked, which holds as
+// long as code is only compiled from symbol lookups. Otherwise create the
+// pool with IsolatePages, so that an allocation never shares a page with
+// another one.
+class MemoryPool {
+public:
+  enum Kind { Code, ROData, RWData, NumKinds };
+
+  explicit MemoryPool(bool IsolatePages = false, uintptr_t SlabSize = 1 << 20)
+      : SlabSize(SlabSize), PageSize(sys::Process::getPageSizeEstimate()),
+        Isolated(IsolatePages) {}
+
+  ~MemoryPool() {
+    for (auto &Slab : Slabs)
+      sys::Memory::releaseMappedMemory(Slab);
+  }
+
+  MemoryPool(const MemoryPool &) = delete;
+  MemoryPool &operator=(const MemoryPool &) = delete;
+
+  // Returns a writable range of Size bytes aligned to Alignment.
+  uint8_t *allocate(Kind K, uintptr_t Size, unsigned Alignment) {
+    if (Isolated) {
+      Size = alignTo(Size, PageSize);
+      Alignment = std::max<uintptr_t>(Alignment, PageSize);
+    }
+    auto Addr = allocateFromFreeBlocks(K, Size, Alignment);
+    if (!Addr) {
+      auto NumBytes =
+          alignTo(std::max<uintptr_t>(SlabSize, Size + Alignment), PageSize);
+      std::error_code EC;
+      auto Slab = sys::Memory::allocateMappedMemory(
+          NumBytes, nullptr, sys::Memory::MF_READ | sys::Memory::MF_WRITE, EC);
+      if (EC)
+        report_fatal_error(Twine("Can't allocate JIT memory: ") + EC.message());
+      Slabs.push_back(Slab);
+      release(K, static_cast<uint8_t *>(Slab.base()), NumBytes);
+      Addr = allocateFromFreeBlocks(K, Size, Alignment);
+    }
+    protect(Addr, Size, sys::Memory::MF_READ | sys::Memory::MF_WRITE);
+    return Addr;
+  }
+
+  // Returns a range to the free blocks of its kind, merging it with its
+  // neighbours.
+  void release(Kind K, uint8_t *Addr, uintptr_t Size) {
+    if (Isolated)
+      Size = alignTo(Size, PageSize);
+    auto &Free = FreeBlocks[K];
+    auto Begin = reinterpret_cast<uintptr_t>(Addr), End = Begin + Size;
+
+    auto Next = Free.lower_bound(Begin);
+    if (Next != Free.end() && Next->first == End) {
+      End += Next->second;
+      Next = Free.erase(Next);
+    }
+    if (Next != Free.begin()) {
+      auto Prev = std::prev(Next);
+      if (Prev->first + Prev->second == Begin) {
+        Begin = Prev->first;
+        Free.erase(Prev);
+      }
+    }
+    Free[Begin] = End - Begin;
+  }
+
+  // Final permissions of a range, applied by endLink.
+  struct Protection {
+    uint8_t *Addr;
+    uintptr_t Size;
+    unsigned Flags;
+  };
+
+  // Called when a memory manager starts laying out an object.
+  void beginLink() { ++Linking; }
+
+  // Called when a memory manager is done with an object. The permissions are
+  // only applied, merged by page, once the last object being linked is done:
+  // resolving one object's relocations can link others that share its pages.
+  std::error_code endLink(const std::vector<Protection> &Protections) {
+    Pending.insert(Pending.end(), Protections.begin(), Protections.end());
+    if (--Linking)
+      return std::error_code();
+
+    std::sort(Pending.begin(), Pending.end(),
+              [](const Protection &L, const Protection &R) {
+                return L.Addr < R.Addr;
+              });
+
+    std::error_code EC;
+    uintptr_t Begin = 0, End = 0;
+    unsigned Flags = 0;
+    for (auto &P : Pending) {
+      auto Addr = reinterpret_cast<uintptr_t>(P.Addr);
+      auto PBegin = alignDown(Addr, PageSize);
+      auto PEnd = alignTo(Addr + P.Size, PageSize);
+      if (End && PBegin <= End && P.Flags == Flags) {
+        End = std::max(End, PEnd);
+        continue;
+      }
+      if (End && !EC)
+        EC = protectPages(Begin, End, Flags);
+      Begin = PBegin;
+      End = PEnd;
+      Flags = P.Flags;
+    }
+    if (End && !EC)
+      EC = protectPages(Begin, End, Flags);
+
+    Pending.clear();
+    return EC;
+  }
+
+private:
+  uint8_t *allocateFromFreeBlocks(Kind K, uintptr_t Size, unsigned Alignment) {
+    auto &Free = FreeBlocks[K];
+    for (auto I = Free.begin(), E = Free.end(); I != E; ++I) {
+      auto Begin = I->first, End = I->first + I->second;
+      auto Start = alignTo(Begin, Alignment);
+      if (Start + Size > End)
+        continue;
+
+      Free.erase(I);
+      if (Start != Begin)
+        Free[Begin] = Start - Begin;
+      if (Start + Size != End)
+        Free[Start + Size] = End - Start - Size;
+      return reinterpret_cast<uint8_t *>(Start);
+    }
+    return nullptr;
+  }
+
+  void protect(uint8_t *Addr, uintptr_t Size, unsigned Flags) {
+    auto Begin = alignDown(reinterpret_cast<uintptr_t>(Addr), PageSize);
+    auto End = alignTo(reinterpret_cast<uintptr_t>(Addr) + Size, PageSize);
+    if (auto EC = protectPages(Begin, End, Flags))
+      report_fatal_error(Twine("Can't change JIT memory permissions: ") +
+                         EC.message());
+  }
+
+  static std::error_code protectPages(uintptr_t Begin, uintptr_t End,
+                                      unsigned Flags) {
+    sys::MemoryBlock Pages(reinterpret_cast<void *>(Begin), End - Begin);
+    if (auto EC = sys::Memory::protectMappedMemory(Pages, Flags))
+      return EC;
+    if (Flags & sys::Memory::MF_EXEC)
+      sys::Memory::InvalidateInstructionCache(Pages.base(), End - Begin);
+    return std::error_code();
+  }
+
+  uintptr_t SlabSize;
+  uintptr_t PageSize;
+  std::vector<sys::MemoryBlock> Slabs;
+  std::map<uintptr_t, uintptr_t> FreeBlocks[NumKinds];
+  unsigned Linking = 0;
+  const bool Isolated;
+  std::vector<Protection> Pending;
+};
+
+// Memory manager for one JIT'd object, handing out memory from a shared
+// MemoryPool and giving it back when the object is removed.
+class PooledMemoryManager : public RTDyldMemoryManager {
+public:
+  explicit PooledMemoryManager(std::shared_ptr<MemoryPool> Pool)
+      : Pool(std::move(Pool)) {}
+
+  ~PooledMemoryManager() override {
+    deregisterEHFrames();
+    if (Linking)
+      Pool->endLink({});
+    for (unsigned K = 0; K != MemoryPool::NumKinds; ++K)
+      for (auto &R : Ranges[K])
+        Pool->release(static_cast<MemoryPool::Kind>(K), R.Addr, R.Size);
+  }
+
+  // Ask for the total size of each kind up front, so that an object takes
+  // one range of each kind from the pool rather than one per section.
+  bool needsToReserveAllocationSpace() override { return true; }
+
+  void reserveAllocationSpace(uintptr_t CodeSize, uint32_t CodeAlign,
+                              uintptr_t RODataSize, uint32_t RODataAlign,
+                              uintptr_t RWDataSize,
+                              uint32_t RWDataAlign) override {
+    reserve(MemoryPool::Code, CodeSize, CodeAlign);
+    reserve(MemoryPool::ROData, RODataSize, RODataAlign);
+    reserve(MemoryPool::RWData, RWDataSize, RWDataAlign);
+  }
+
+  uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID,
+                               StringRef SectionName) override {
+    return allocate(MemoryPool::Code, Size, Alignment);
+  }
+
+  uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID, StringRef SectionName,
+                               bool IsReadOnly) override {
+    return allocate(IsReadOnly ? MemoryPool::ROData : MemoryPool::RWData, Size,
+                    Alignment);
+  }
+
+  bool finalizeMemory(std::string *ErrMsg) override {
+    if (!Linking)
+      return false;
+    Linking = false;
+
+    std::vector<MemoryPool::Protection> Protections;
+    for (auto &R : Ranges[MemoryPool::Code])
+      Protections.push_back(
+          {R.Addr, R.Size, sys::Memory::MF_READ | sys::Memory::MF_EXEC});
+    for (auto &R : Ranges[MemoryPool::ROData])
+      Protections.push_back({R.Addr, R.Size, sys::Memory::MF_READ});
+
+    if (auto EC = Pool->endLink(Protections)) {
+      if (ErrMsg)
+        *ErrMsg = EC.message();
+      return true;
+    }
+    return false;
+  }
+
+private:
+  struct Range {
+    uint8_t *Addr;
+    uintptr_t Size;
+    uintptr_t Used;
+  };
+
+  void reserve(MemoryPool::Kind K, uintptr_t Size, unsigned Alignment) {
+    if (!Size)
+      return;
+    begin();
+    Alignment = Alignment ? Alignment : 16;
+    Ranges[K].push_back({Pool->allocate(K, Size, Alignment), Size, 0});
+  }
+
+  // Bump-allocate from the last range of this kind, or take a new range from
+  // the pool if the reservation was too small.
+  uint8_t *allocate(MemoryPool::Kind K, uintptr_t Size, unsigned Alignment) {
+    begin();
+    Alignment = Alignment ? Alignment : 16;
+    if (!Ranges[K].empty()) {
+      auto &R = Ranges[K].back();
+      auto Base = reinterpret_cast<uintptr_t>(R.Addr);
+      auto Start = alignTo(Base + R.Used, Alignment);
+      if (Start + Size <= Base + R.Size) {
+        R.Used = Start + Size - Base;
+        return reinterpret_cast<uint8_t *>(Start);
+      }
+    }
+    Ranges[K].push_back({Pool->allocate(K, Size, Alignment), Size, Size});
+    return Ranges[K].back().Addr;
+  }
+
+  void begin() {
+    if (!Linking) {
+      Linking = true;
+      Pool->beginLink();
+    }
+  }
+
+  std::shared_ptr<MemoryPool> Pool;
+  std::vector<Range> Ranges[MemoryPool::NumKinds];
+  bool Linking = false;
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // KALEIDOSCOPE_POOLEDMEMORYMANAGER_H
@@ -0,0 +1,279 @@
+#include <set>
+#include <cstdio>
+#include <string>
+#include <sstream>
+
+#include "node.hpp"
+#include "session.hpp"
+#include "llvm/Support/xxhash.h"
+
+using namespace std;
+
+namespace kaleidoscope
+{
+void UnaryExprAST::collect_callees(set<string> &callees) const
+{
+    callees.insert("unary"s + op_);
+    operand_->collect_callees(callees);
+}
+
+void BinaryExprAST::collect_callees(set<string> &callees) const
+{
+    switch (op_)
+    {
+    case '=':
+    case '+':
+    case '-':
+    case '*':
+    case '<':
+        break;
+    default:
+        callees.insert("binary"s + op_);
+        break;
+    }
+    lhs_->collect_callees(callees);
+    rhs_->collect_callees(callees);
+}
+
+void CallExprAST::collect_callees(set<string> &callees) const
+{
+    callees.insert(callee_);
+    for (auto &arg : args_)
+    {
+        arg->collect_callees(callees);
+    }
+}
+
+void IfExprAST::collect_callees(set<string> &callees) const
+{
+    cond_->collect_callees(callees);
+    then_->collect_callees(callees);
+    else_->collect_callees(callees);
+}
+
+void ForExprAST::collect_callees(set<string> &callees) const
+{
+    start_->collect_callees(callees);
+    end_->collect_callees(callees);
+    if (step_)
+    {
+        step_->collect_callees(callees);
+    }
+    body_->collect_callees(callees);
+}
+
+void ParForExprAST::collect_callees(set<string> &callees) const
+{
+    // the body runs on other threads, so a function with a parfor is never
+    // considered pure
+    callees.insert("kaleidoscope_parfor");
+    start_->collect_callees(callees);
+    end_->collect_callees(callees);
+    if (step_)
+    {
+        step_->collect_callees(callees);
+    }
+    body_->collect_callees(callees);
+}
+
+void VarExprAST::collect_callees(set<string> &callees) const
+{
+    for (auto &varname_exprast : var_names_)
+    {
+        if (varname_exprast.second)
+        {
+            varname_exprast.second->collect_callees(callees);
+        }
+    }
+    body_->collect_callees(callees);
+}
+
+void UnaryExprAST::collect_assigned(set<string> &names) const
+{
+    operand_->collect_assigned(names);
+}
+
+void BinaryExprAST::collect_assigned(set<string> &names) const
+{
+    if (op_ == '=')
+    {
+        if (auto lhs = dynamic_cast<const VariableExprAST*>(lhs_.get()))
+        {
+            names.insert(lhs->get_name());
+        }
+    }
+    lhs_->collect_assigned(names);
+    rhs_->collect_assigned(names);
+}
+
+void CallExprAST::collect_assigned(set<string> &names) const
+{
+    // the callee can't see the variables of its caller
+    for (auto &arg : args_)
+    {
+        arg->collect_assigned(names);
+    }
+}
+
+void IfExprAST::collect_assigned(set<string> &names) const
+{
+    cond_->collect_assigned(names);
+    then_->collect_assigned(names);
+    else_->collect_assigned(names);
+}
+
+void ForExprAST::collect_assigned(set<string> &names) const
+{
+    names.insert(var_name_);
+    start_->collect_assigned(names);
+    end_->collect_assigned(names);
+    if (step_)
+    {
+        step_->collect_assigned(names);
+    }
+    body_->collect_assigned(names);
+}
+
+void ParForExprAST::collect_assigned(set<string> &names) const
+{
+    names.insert(var_name_);
+    start_->collect_assigned(names);
+    end_->collect_assigned(names);
+    if (step_)
+    {
+        step_->collect_assigned(names);
+    }
+    body_->collect_assigned(names);
+}
+
+void VarExprAST::collect_assigned(set<string> &names) const
+{
+    for (auto &varname_exprast : var_names_)
+    {
+        names.insert(varname_exprast.first);
+        if (varname_exprast.second)
+        {
+            varname_exprast.second->collect_assigned(names);
+        }
+    }
+    body_->collect_assigned(names);
+}
+
+void NumberExprAST::write_key(string &key) const
+{
+    // hexadecimal floating point is exact
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%a", value_);
+    key += "n"s + buf + " ";
+}
+
+void VariableExprAST::write_key(string &key) const
+{
+    key += "v" + name_ + " ";
+}
+
+void UnaryExprAST::write_key(string &key) const
+{
+    key += "u"s + op_;
+    operand_->write_key(key);
+}
+
+void BinaryExprAST::write_key(string &key) const
+{
+    key += "b"s + op_;
+    lhs_->write_key(key);
+    rhs_->write_key(key);
+}
+
+void CallExprAST::write_key(string &key) const
+{
+    key += "c" + callee_ + " " + to_string(args_.size()) + " ";
+    for (auto &arg : args_)
+    {
+        arg->write_key(key);
+    }
+}
+
+void IfExprAST::write_key(string &key) const
+{
+    key += "i";
+    cond_->write_key(key);
+    then_->write_key(key);
+    else_->write_key(key);
+}
+
+void ForExprAST::write_key(string &key) const
+{
+    key += "f" + var_name_ + " " + (step_ ? "s" : "");
+    start_->write_key(key);
+    end_->write_key(key);
+    if (step_)
+    {
+        step_->write_key(key);
+    }
+    body_->write_key(key);
+}
+
+void ParForExprAST::write_key(string &key) const
+{
+    key += "p" + var_name_ + " " + (step_ ? "s" : "") + (reduce_op_ ? reduce_op_ : ' ');
+    start_->write_key(key);
+    end_->write_key(key);
+    if (step_)
+    {
+        step_->write_key(key);
+    }
+    body_->write_key(key);
+}
+
+void VarExprAST::write_key(string &key) const
+{
+    key += "r" + to_string(var_names_.size()) + " ";
+    for (auto &varname_exprast : var_names_)
+    {
+        key += varname_exprast.first + (varname_exprast.second ? " =" : " ");
+        if (varname_exprast.second)
+        {
+            varname_exprast.second->write_key(key);
+        }
+    }
+    body_->write_key(key);
+}
+
+uint64_t FunctionAST::fingerprint() const
+{
+    string key = proto_->get_name() + " " + to_string(proto_->is_operator())
+        + " " + to_string(proto_->get_binary_precedence());
+    for (auto &arg : proto_->get_args())
+    {
+        key += " " + arg;
+    }
+    key += "\n";
+    body_->write_key(key);
+    key += "\n";
+
+    // calls compile against the callee's prototype and purity; without
+    // stubs they also bind to its current definition
+    set<string> callees;
+    body_->collect_callees(callees);
+    for (auto &callee : callees)
+    {
+        if (callee == proto_->get_name())
+        {
+            continue;
+        }
+        ostringstream signature;
+        auto it = FunctionProtos.find(callee);
+        if (it != FunctionProtos.end())
+        {
+            write_prototype(signature, *it->second);
+        }
+        if (!Indirection && Fingerprints.count(callee))
+        {
+            signature << ' ' << Fingerprints[callee];
+        }
+        key += callee + ": " + signature.str() + "\n";
+    }
+    return llvm::xxHash64(key);
+}
+} // namespace kaleidoscope
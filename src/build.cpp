@@ -0,0 +1,287 @@
+#include <map>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include "node.hpp"
+#include "emit.hpp"
+#include "build.hpp"
+#include "parser.hpp"
+#include "session.hpp"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/xxhash.h"
+
+using namespace std;
+using namespace llvm;
+
+// An interface file holds
+//
+//   kaleidoscope-interface 1
+//   source <hash of the source>
+//   exports <n>
+//   <prototype as written by write_prototype>   (n lines)
+//   imports <n>
+//   <name> <hash of its exported prototype, 0 if no file exports it>
+namespace
+{
+using namespace kaleidoscope;
+
+const char *Magic = "kaleidoscope-interface";
+const int Version = 1;
+
+struct Unit
+{
+    string source, object, interface;
+    uint64_t source_hash = 0;
+    // exported prototypes and imported signatures, as of the last build
+    map<string, string> exports;
+    map<string, uint64_t> imports;
+    bool dirty = true;
+};
+
+// Exports - the unit exporting each name and its prototype line
+map<string, pair<size_t, string>> Exports;
+
+uint64_t signature(const string &name)
+{
+    auto it = Exports.find(name);
+    return it == Exports.end() ? 0 : xxHash64(it->second.second);
+}
+
+bool read_unit_interface(Unit &unit)
+{
+    ifstream in(unit.interface);
+    string magic, section, line;
+    int version;
+    uint64_t source_hash;
+    size_t num_exports, num_imports;
+    if (!(in >> magic >> version >> section >> source_hash >> section >> num_exports)
+        || magic != Magic || version != Version)
+    {
+        return false;
+    }
+    getline(in, line);
+    for (size_t i = 0; i < num_exports && getline(in, line); ++i)
+    {
+        unit.exports[line.substr(0, line.find(' '))] = line;
+    }
+    in >> section >> num_imports;
+    for (size_t i = 0; in && i < num_imports; ++i)
+    {
+        string name;
+        uint64_t hash;
+        in >> name >> hash;
+        unit.imports[name] = hash;
+    }
+    unit.source_hash = source_hash;
+    return bool(in);
+}
+
+bool write_unit_interface(const Unit &unit)
+{
+    ofstream out(unit.interface);
+    out << Magic << ' ' << Version << '\n'
+        << "source " << unit.source_hash << '\n'
+        << "exports " << unit.exports.size() << '\n';
+    for (auto &name_line : unit.exports)
+    {
+        out << name_line.second << '\n';
+    }
+    out << "imports " << unit.imports.size() << '\n';
+    for (auto &name_hash : unit.imports)
+    {
+        out << name_hash.first << ' ' << name_hash.second << '\n';
+    }
+    return bool(out);
+}
+
+// stale_imports - whether a signature the unit was compiled against changed
+bool stale_imports(const Unit &unit)
+{
+    return any_of(unit.imports.begin(), unit.imports.end(), [](const pair<const string, uint64_t> &import)
+    {
+        return signature(import.first) != import.second;
+    });
+}
+
+// compile_unit - compile one file against the exports of all the others
+bool compile_unit(Unit &unit, size_t index, TargetMachine *target_machine)
+{
+    FunctionProtos.clear();
+    FunctionBodies.clear();
+    PureFunctions = LibmFunctions;
+    Callers.clear();
+    Parser::reset_precedences();
+    for (auto &export_ : Exports)
+    {
+        if (export_.second.first != index)
+        {
+            istringstream in(export_.second.second);
+            read_prototype(in);
+        }
+    }
+    initialize_module();
+
+    if (!freopen(unit.source.c_str(), "r", stdin))
+    {
+        fprintf(stderr, "Could not read %s\n", unit.source.c_str());
+        return false;
+    }
+    // a unit with errors lacks the items that failed: neither its object nor
+    // its interface is written, so it is compiled again next time
+    auto errors = ErrorCount;
+    Parser().main_loop();
+    if (ErrorCount != errors)
+    {
+        return false;
+    }
+
+    unit.exports.clear();
+    unit.imports.clear();
+    for (auto &f : TheModule->functions())
+    {
+        auto name = f.getName().str();
+        if (f.isDeclaration())
+        {
+            unit.imports[name] = 0;
+        }
+        else if (!f.hasLocalLinkage() && name != "__anno_expr" && FunctionProtos.count(name))
+        {
+            ostringstream line;
+            write_prototype(line, *FunctionProtos[name]);
+            unit.exports[name] = line.str();
+        }
+    }
+
+    if (!emit_object(*TheModule, target_machine, unit.object))
+    {
+        return false;
+    }
+
+    // the signatures are recorded once the unit's own exports are in place,
+    // as they are what dependents will see
+    for (auto it = Exports.begin(); it != Exports.end();)
+    {
+        it = it->second.first == index ? Exports.erase(it) : next(it);
+    }
+    for (auto &export_ : unit.exports)
+    {
+        Exports[export_.first] = { index, export_.second };
+    }
+    for (auto &import : unit.imports)
+    {
+        import.second = signature(import.first);
+    }
+    return write_unit_interface(unit);
+}
+} // namespace
+
+namespace kaleidoscope
+{
+bool build_project(const string &dir, TargetMachine *target_machine)
+{
+    vector<Unit> units;
+    std::error_code ec;
+    for (sys::fs::directory_iterator it(dir, ec), end; it != end && !ec; it.increment(ec))
+    {
+        if (sys::path::extension(it->path()) != ".ks")
+        {
+            continue;
+        }
+        Unit unit;
+        unit.source = it->path();
+        SmallString<128> path(unit.source);
+        sys::path::replace_extension(path, ".o");
+        unit.object = path.str().str();
+        sys::path::replace_extension(path, ".ki");
+        unit.interface = path.str().str();
+        units.push_back(move(unit));
+    }
+    if (ec)
+    {
+        fprintf(stderr, "Could not read directory %s: %s\n", dir.c_str(), ec.message().c_str());
+        return false;
+    }
+    std::sort(units.begin(), units.end(), [](const Unit &l, const Unit &r)
+    {
+        return l.source < r.source;
+    });
+
+    // a unit is up to date if its source is unchanged since its object and
+    // interface were written
+    for (size_t i = 0; i < units.size(); ++i)
+    {
+        auto &unit = units[i];
+        auto source = MemoryBuffer::getFile(unit.source);
+        if (!source)
+        {
+            fprintf(stderr, "Could not read %s\n", unit.source.c_str());
+            return false;
+        }
+        auto source_hash = xxHash64((*source)->getBuffer());
+        auto interface_current = read_unit_interface(unit) && unit.source_hash == source_hash;
+        unit.dirty = !interface_current || !sys::fs::exists(unit.object);
+        unit.source_hash = source_hash;
+
+        // without a current interface, take the exports from the source so
+        // that the units compiled before this one see them too. They are
+        // taken to be pure: should the unit turn out otherwise, its exports
+        // change and the units that relied on that are compiled again
+        if (!interface_current)
+        {
+            unit.exports.clear();
+            for (auto &proto : Parser((*source)->getBuffer().str()).scan_prototypes(true))
+            {
+                PureFunctions.insert(proto->get_name());
+                ostringstream line;
+                write_prototype(line, *proto);
+                unit.exports[proto->get_name()] = line.str();
+            }
+        }
+        for (auto &export_ : unit.exports)
+        {
+            Exports[export_.first] = { i, export_.second };
+        }
+    }
+    for (auto &unit : units)
+    {
+        unit.dirty = unit.dirty || stale_imports(unit);
+    }
+
+    // compiling a unit can change its exports and so make its dependents
+    // stale, keep going until nothing is left to compile
+    size_t compiled = 0;
+    while (true)
+    {
+        auto it = find_if(units.begin(), units.end(), [](const Unit &unit) { return unit.dirty; });
+        if (it == units.end())
+        {
+            break;
+        }
+
+        auto exports = it->exports;
+        if (!compile_unit(*it, it - units.begin(), target_machine))
+        {
+            return false;
+        }
+        it->dirty = false;
+        ++compiled;
+
+        if (it->exports != exports)
+        {
+            for (auto &unit : units)
+            {
+                unit.dirty = unit.dirty || stale_imports(unit);
+            }
+        }
+    }
+
+    fprintf(stderr, "compiled %zu of %zu files\n", compiled, units.size());
+    return true;
+}
+} // namespace kaleidoscope
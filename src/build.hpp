@@ -0,0 +1,18 @@
+#ifndef KALEIDOSCOPE_BUILD_HPP
+#define KALEIDOSCOPE_BUILD_HPP
+
+#include <string>
+
+#include "llvm/Target/TargetMachine.h"
+
+namespace kaleidoscope
+{
+// build_project - compile every .ks file of a directory to an object next
+// to it, each seeing the functions and operators of all the others. An
+// interface file (.ki) records what a file exports and the signatures it
+// imported, so that a file is only compiled again when its source or one
+// of those signatures changed.
+bool build_project(const std::string &dir, llvm::TargetMachine *target_machine);
+} // namespace kaleidoscope
+
+#endif // KALEIDOSCOPE_BUILD_HPP
@@ -1,13 +1,489 @@
+#include <map>
+#include <deque>
+#include <mutex>
+#include <atomic>
 #include <cstdio>
+#include <thread>
+#include <cstdlib>
+#include <shared_mutex>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <unordered_map>
+#include <condition_variable>
+
+#include "stats.hpp"
+#include "number.hpp"
+#include "builtin.hpp"
+
+namespace
+{
+// OutputBuffer - output of the calling thread to a stdio stream, written out
+// when the buffer fills, on flushd and when the thread exits
+class OutputBuffer
+{
+  public:
+    static constexpr size_t Capacity = 1 << 16;
+
+    explicit OutputBuffer(FILE *stream) : stream_(stream), data_(new char[Capacity]) {}
+    ~OutputBuffer() { flush(); }
+
+    // reserve - room for n more bytes, to be claimed with commit
+    char *reserve(size_t n)
+    {
+        if (size_ + n > Capacity)
+        {
+            flush();
+        }
+        return data_.get() + size_;
+    }
+    void commit(char *end) { size_ = end - data_.get(); }
+
+    void put(char c)
+    {
+        auto out = reserve(1);
+        *out = c;
+        commit(out + 1);
+    }
+
+    void flush()
+    {
+        if (size_)
+        {
+            fwrite(data_.get(), 1, size_, stream_);
+            fflush(stream_);
+            size_ = 0;
+        }
+    }
+
+  private:
+    FILE *stream_;
+    std::unique_ptr<char[]> data_;
+    size_t size_ = 0;
+};
+
+thread_local OutputBuffer Out(stdout), Err(stderr);
+
+// KALEIDOSCOPE_UNBUFFERED restores writing every character and number to
+// stdio as soon as it is printed
+const bool Unbuffered = getenv("KALEIDOSCOPE_UNBUFFERED") != nullptr;
+
+// write_number - x followed by a newline
+void write_number(OutputBuffer &buffer, double x)
+{
+    auto out = buffer.reserve(kaleidoscope::MaxNumberLength + 1);
+    auto end = kaleidoscope::format_number(out, x);
+    *end = '\n';
+    buffer.commit(end + 1);
+}
+} // namespace
 
 extern "C" double putchard(double c)
 {
-    fputc((char)c, stderr);
+    if (Unbuffered)
+    {
+        fputc((char)c, stderr);
+        return 0.0;
+    }
+    Err.put((char)c);
     return 0.0;
 }
 
 extern "C" double printd(double x)
 {
-    printf("%lf\n", x);
+    if (Unbuffered)
+    {
+        printf("%s\n", kaleidoscope::format_number(x).c_str());
+        return 0.0;
+    }
+    write_number(Out, x);
+    return 0.0;
+}
+
+// putchardn - putchard(c) n times
+extern "C" double putchardn(double c, double n)
+{
+    for (double i = 0; i < n; ++i)
+    {
+        putchard(c);
+    }
     return 0.0;
 }
+
+// printdrange - printd every value start, start + step, ... below end
+extern "C" double printdrange(double start, double end, double step)
+{
+    if (!(step > 0))
+    {
+        return 0.0;
+    }
+    for (double i = 0, x = start; x < end; x = start + ++i * step)
+    {
+        printd(x);
+    }
+    return 0.0;
+}
+
+extern "C" double flushd()
+{
+    Out.flush();
+    Err.flush();
+    return 0.0;
+}
+
+// dumpstats - print the statistics gathered so far, in the format chosen on
+// the command line (text if none was)
+extern "C" double dumpstats()
+{
+    using namespace kaleidoscope;
+    flushd();
+    print_stats(stderr, StatsOutput == StatsFormat::Json ? StatsFormat::Json : StatsFormat::Text);
+    return 0.0;
+}
+
+// memo tables used by functions compiled with --memoize, keyed by the raw
+// bytes of the argument list; *table is lazily allocated per definition.
+// Memoized functions may run on parfor and batch threads, so all tables are
+// guarded by one lock, shared by lookups
+using MemoTable = std::unordered_map<std::string, double>;
+
+namespace
+{
+std::shared_mutex memo_mutex;
+} // namespace
+
+extern "C" int kaleidoscope_memo_lookup(void **table, const double *args, int nargs, double *result)
+{
+    std::shared_lock<std::shared_mutex> lock(memo_mutex);
+    if (!*table)
+    {
+        return 0;
+    }
+    auto memo = static_cast<MemoTable *>(*table);
+    auto it = memo->find(std::string((const char *)args, nargs * sizeof(double)));
+    if (it == memo->end())
+    {
+        return 0;
+    }
+    *result = it->second;
+    return 1;
+}
+
+extern "C" void kaleidoscope_memo_store(void **table, const double *args, int nargs, double result)
+{
+    std::lock_guard<std::shared_mutex> lock(memo_mutex);
+    if (!*table)
+    {
+        *table = new MemoTable();
+    }
+    auto memo = static_cast<MemoTable *>(*table);
+    (*memo)[std::string((const char *)args, nargs * sizeof(double))] = result;
+}
+
+// ProfileData - per-function counters emitted by --profile-generate, the
+// layout must match the struct built in profile.cpp
+struct ProfileData
+{
+    const char *name;
+    const char *file;
+    int64_t registered;
+    int64_t num_counters;
+    uint64_t counters[1];
+};
+
+namespace
+{
+std::mutex profiles_mutex;
+std::vector<ProfileData *> profiles;
+
+// write_profiles - write out the registered profiles and forget them, as
+// their data may be about to go with the JIT holding it; functions that run
+// again register anew
+void write_profiles()
+{
+    std::lock_guard<std::mutex> lock(profiles_mutex);
+    std::map<std::string, FILE *> files;
+    for (auto data : profiles)
+    {
+        auto &out = files[data->file];
+        if (!out && !(out = fopen(data->file, "w")))
+        {
+            fprintf(stderr, "Could not write profile: %s\n", data->file);
+            continue;
+        }
+
+        fprintf(out, "%s %lld", data->name, (long long)data->num_counters);
+        for (int64_t i = 0; i < data->num_counters; ++i)
+        {
+            fprintf(out, " %llu", (unsigned long long)data->counters[i]);
+        }
+        fputc('\n', out);
+    }
+
+    for (auto &name_file : files)
+    {
+        if (name_file.second)
+        {
+            fclose(name_file.second);
+        }
+    }
+
+    for (auto data : profiles)
+    {
+        __atomic_store_n(&data->registered, 0, __ATOMIC_RELEASE);
+    }
+    profiles.clear();
+}
+} // namespace
+
+// profiled functions may run on several threads at once: counters are
+// incremented atomically, and registration is checked again under the lock
+extern "C" void kaleidoscope_profile_enter(ProfileData *data)
+{
+    if (!__atomic_load_n(&data->registered, __ATOMIC_ACQUIRE))
+    {
+        std::lock_guard<std::mutex> lock(profiles_mutex);
+        if (!data->registered)
+        {
+            static bool at_exit = false;
+            if (!at_exit)
+            {
+                atexit(write_profiles);
+                at_exit = true;
+            }
+            profiles.push_back(data);
+            __atomic_store_n(&data->registered, 1, __ATOMIC_RELEASE);
+        }
+    }
+    __atomic_fetch_add(&data->counters[0], 1, __ATOMIC_RELAXED);
+}
+
+extern "C" void kaleidoscope_write_profiles()
+{
+    write_profiles();
+}
+
+// parfor runtime: iterations are split into ranges on per-worker deques.
+// A worker runs ranges from the back of its own deque, halving large ones and
+// pushing the upper halves back, and steals from the front of the others',
+// where the largest ranges are, once its own is empty. The thread running the
+// parfor helps until all of its iterations are done, so nested parfors can't
+// deadlock the pool.
+namespace
+{
+using ParForChunk = void (*)(double *env, int64_t begin, int64_t end, double *result);
+
+struct ParForJob
+{
+    ParForChunk chunk;
+    double *env;
+    int op;
+    int64_t grain;
+    std::atomic<int64_t> remaining;
+    std::mutex mutex;
+    double result;
+};
+
+struct ParForRange
+{
+    ParForJob *job;
+    int64_t begin, end;
+};
+
+class WorkStealingPool
+{
+  public:
+    explicit WorkStealingPool(size_t threads)
+      : queues_(threads)
+    {
+        for (size_t i = 0; i < threads; ++i)
+        {
+            queues_[i] = std::make_unique<Queue>();
+        }
+        for (size_t i = 0; i < threads; ++i)
+        {
+            std::thread([this, i] { work(i); }).detach();
+        }
+    }
+
+    size_t size() const { return queues_.size(); }
+
+    void run(ParForJob &job, int64_t n)
+    {
+        // deal one range to every worker, they split them further on demand
+        auto threads = static_cast<int64_t>(queues_.size());
+        for (int64_t i = 0; i < threads; ++i)
+        {
+            auto begin = n * i / threads, end = n * (i + 1) / threads;
+            if (begin != end)
+            {
+                auto &queue = *queues_[i];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                queue.ranges.push_back({ &job, begin, end });
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            ++active_;
+        }
+        wake_.notify_all();
+
+        ParForRange range;
+        while (job.remaining.load(std::memory_order_acquire) > 0)
+        {
+            if (find(WorkerIndex, range))
+            {
+                execute(WorkerIndex, range);
+            }
+            else
+            {
+                std::this_thread::yield();
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        --active_;
+    }
+
+  private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<ParForRange> ranges;
+    };
+
+    static thread_local size_t WorkerIndex;
+
+    void work(size_t self)
+    {
+        WorkerIndex = self;
+        ParForRange range;
+        for (;;)
+        {
+            if (find(self, range))
+            {
+                execute(self, range);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleep_mutex_);
+            if (!active_)
+            {
+                wake_.wait(lock, [this] { return active_ > 0; });
+            }
+            else
+            {
+                lock.unlock();
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    // find - pop from the back of our own deque, or steal from the front of
+    // another; self is out of range for threads outside the pool
+    bool find(size_t self, ParForRange &range)
+    {
+        if (self < queues_.size())
+        {
+            auto &queue = *queues_[self];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.ranges.empty())
+            {
+                range = queue.ranges.back();
+                queue.ranges.pop_back();
+                return true;
+            }
+        }
+        for (size_t i = 1; i <= queues_.size(); ++i)
+        {
+            auto &queue = *queues_[(self + i) % queues_.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.ranges.empty())
+            {
+                range = queue.ranges.front();
+                queue.ranges.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void execute(size_t self, ParForRange range)
+    {
+        auto &job = *range.job;
+        if (self < queues_.size())
+        {
+            auto &queue = *queues_[self];
+            while (range.end - range.begin > job.grain)
+            {
+                auto mid = range.begin + (range.end - range.begin) / 2;
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                queue.ranges.push_back({ &job, mid, range.end });
+                range.end = mid;
+            }
+        }
+
+        double partial;
+        job.chunk(job.env, range.begin, range.end, &partial);
+        // workers never exit, so their output can't wait for that
+        flushd();
+        if (job.op)
+        {
+            std::lock_guard<std::mutex> lock(job.mutex);
+            job.result = job.op == 2 ? job.result * partial : job.result + partial;
+        }
+        job.remaining.fetch_sub(range.end - range.begin, std::memory_order_release);
+    }
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+    size_t active_ = 0;
+};
+
+thread_local size_t WorkStealingPool::WorkerIndex = SIZE_MAX;
+
+// the pool lives as long as the process, its threads are never joined;
+// KALEIDOSCOPE_THREADS overrides the number of workers
+WorkStealingPool &parfor_pool()
+{
+    static auto pool = [] {
+        size_t threads = std::thread::hardware_concurrency();
+        if (auto env = getenv("KALEIDOSCOPE_THREADS"))
+        {
+            threads = strtoul(env, nullptr, 10);
+        }
+        return new WorkStealingPool(std::max<size_t>(threads, 1));
+    }();
+    return *pool;
+}
+} // namespace
+
+// kaleidoscope_parfor - run chunk over iterations [0, n) on the pool and
+// combine the partial results with op (0 none, 1 '+', 2 '*')
+extern "C" double kaleidoscope_parfor(ParForChunk chunk, double *env, int64_t n, int op)
+{
+    ParForJob job;
+    job.chunk = chunk;
+    job.env = env;
+    job.op = op;
+    job.result = op == 2 ? 1.0 : 0.0;
+    if (n <= 0)
+    {
+        return job.result;
+    }
+
+    auto &pool = parfor_pool();
+    // a few ranges per worker balance uneven iterations without paying for
+    // many tiny chunks
+    job.grain = std::max<int64_t>(1, n / static_cast<int64_t>(pool.size() * 8));
+    job.remaining = n;
+    if (pool.size() == 1)
+    {
+        chunk(env, 0, n, &job.result);
+        return job.result;
+    }
+    pool.run(job, n);
+    return job.result;
+}
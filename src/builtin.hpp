@@ -0,0 +1,15 @@
+#ifndef KALEIDOSCOPE_BUILTIN_HPP
+#define KALEIDOSCOPE_BUILTIN_HPP
+
+// flushd - write out the output that putchard, printd and their bulk
+// variants buffered on the calling thread. The REPL calls it after every
+// top-level expression so that output stays in order with its own.
+extern "C" double flushd();
+
+// kaleidoscope_write_profiles - write out the counters of the profiled
+// functions that ran. Compiled programs write theirs at exit, but thread_local
+// JITs are destroyed before atexit handlers run, so a JIT holding profiled
+// code must call it before it goes.
+extern "C" void kaleidoscope_write_profiles();
+
+#endif // KALEIDOSCOPE_BUILTIN_HPP
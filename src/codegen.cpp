@@ -1,9 +1,16 @@
+#include <set>
 #include <memory>
 #include <string>
+#include <vector>
+#include <utility>
 #include <algorithm>
+#include <cmath>
 
 #include "node.hpp"
 #include "parser.hpp"
+#include "profile.hpp"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/IR/Intrinsics.h"
 
 using namespace std;
 using namespace llvm;
@@ -22,9 +29,179 @@ Function *get_function(const string &name)
         return FunctionProtos[name]->codegen();
     }
 
+    if (ImportedProtos)
+    {
+        auto it = ImportedProtos->find(name);
+        if (it != ImportedProtos->end())
+        {
+            auto &proto = FunctionProtos[name] = std::make_unique<PrototypeAST>(*it->second);
+            return proto->codegen();
+        }
+    }
+
     return nullptr;
 }
 
+// apply_effect_attributes - tag functions known to be pure so that calls to
+// them can be CSE'd and hoisted by GVN
+void apply_effect_attributes(Function *f)
+{
+    // instrumented functions write their counters, so they are never pure
+    if (PureFunctions.count(f->getName().str()) && ProfileGenerate.empty())
+    {
+        f->addFnAttr(Attribute::ReadNone);
+        f->addFnAttr(Attribute::NoUnwind);
+    }
+    else
+    {
+        f->removeFnAttr(Attribute::ReadNone);
+        f->removeFnAttr(Attribute::NoUnwind);
+    }
+}
+
+// drop_purity - forget that the callers of name are pure, transitively, and
+// untag those defined in the current module, along with their specialized
+// copies
+void drop_purity(const string &name)
+{
+    vector<string> work { name };
+    while (!work.empty())
+    {
+        auto callers = Callers.find(work.back());
+        work.pop_back();
+        if (callers == Callers.end())
+        {
+            continue;
+        }
+        for (auto &caller : callers->second)
+        {
+            if (!PureFunctions.erase(caller))
+            {
+                continue;
+            }
+            work.push_back(caller);
+            for (auto &f : TheModule->functions())
+            {
+                if (f.getName() == caller || f.getName().startswith(caller + ".spec."))
+                {
+                    f.removeFnAttr(Attribute::ReadNone);
+                    f.removeFnAttr(Attribute::NoUnwind);
+                }
+            }
+        }
+    }
+}
+
+// emit_memo_lookup - emit a probe of the function's memo table at the entry
+// block, returning early on a hit. Returns the table and the argument buffer
+// which are needed again to record the result.
+pair<Value *, Value *> emit_memo_lookup(Function *the_function)
+{
+    auto double_ty = Type::getDoubleTy(TheContext);
+    auto table_ty = Type::getInt8PtrTy(TheContext);
+    auto int_ty = Type::getInt32Ty(TheContext);
+    auto nargs = ConstantInt::get(int_ty, the_function->arg_size());
+
+    auto table = new GlobalVariable(*TheModule, table_ty, false,
+        GlobalValue::InternalLinkage, ConstantPointerNull::get(table_ty),
+        the_function->getName() + ".memo");
+
+    auto args = Builder.CreateAlloca(double_ty, nargs, "memo.args");
+    size_t idx = 0;
+    for (auto &arg : the_function->args())
+    {
+        Builder.CreateStore(&arg, Builder.CreateConstInBoundsGEP1_32(double_ty, args, idx++));
+    }
+    auto result = Builder.CreateAlloca(double_ty, nullptr, "memo.result");
+
+    auto lookup = TheModule->getOrInsertFunction("kaleidoscope_memo_lookup",
+        int_ty, table_ty->getPointerTo(), double_ty->getPointerTo(), int_ty, double_ty->getPointerTo());
+    auto hit = Builder.CreateCall(lookup, { table, args, nargs, result }, "memo.hit");
+
+    auto hit_bb = BasicBlock::Create(TheContext, "memo.hit", the_function);
+    auto miss_bb = BasicBlock::Create(TheContext, "memo.miss", the_function);
+    Builder.CreateCondBr(Builder.CreateICmpNE(hit, ConstantInt::get(int_ty, 0)), hit_bb, miss_bb);
+
+    Builder.SetInsertPoint(hit_bb);
+    Builder.CreateRet(Builder.CreateLoad(result));
+
+    Builder.SetInsertPoint(miss_bb);
+    return { table, args };
+}
+
+void emit_memo_store(Value *table, Value *args, Value *ret_val)
+{
+    auto double_ty = Type::getDoubleTy(TheContext);
+    auto int_ty = Type::getInt32Ty(TheContext);
+    auto the_function = Builder.GetInsertBlock()->getParent();
+
+    auto store = TheModule->getOrInsertFunction("kaleidoscope_memo_store",
+        Type::getVoidTy(TheContext), table->getType(), double_ty->getPointerTo(), int_ty, double_ty);
+    Builder.CreateCall(store, { table, args, ConstantInt::get(int_ty, the_function->arg_size()), ret_val });
+}
+
+// emit_batch_wrapper - emit <f>_batch(columns, out, begin, end), which sets
+// out[i] = f(columns[0][i], columns[1][i], ...) for i in [begin, end). The
+// call is inlined so that the loop can be vectorized.
+void emit_batch_wrapper(Function *the_function)
+{
+    auto double_ty = Type::getDoubleTy(TheContext);
+    auto double_ptr_ty = double_ty->getPointerTo();
+    auto index_ty = Type::getInt64Ty(TheContext);
+    // a redefinition in the same module replaces the old wrapper
+    if (auto old = TheModule->getFunction(the_function->getName().str() + "_batch"))
+    {
+        old->eraseFromParent();
+    }
+
+    auto wrapper_ty = FunctionType::get(Type::getVoidTy(TheContext),
+        { double_ptr_ty->getPointerTo(), double_ptr_ty, index_ty, index_ty }, false);
+    auto wrapper = Function::Create(wrapper_ty, Function::ExternalLinkage,
+        the_function->getName() + "_batch", TheModule.get());
+    auto arg = wrapper->arg_begin();
+    Value *columns = arg++, *out = arg++, *begin = arg++, *end = arg++;
+    columns->setName("columns");
+    out->setName("out");
+    begin->setName("begin");
+    end->setName("end");
+    wrapper->addParamAttr(1, Attribute::NoAlias);
+
+    auto entry_bb = BasicBlock::Create(TheContext, "entry", wrapper);
+    auto loop_bb = BasicBlock::Create(TheContext, "loop", wrapper);
+    auto body_bb = BasicBlock::Create(TheContext, "body", wrapper);
+    auto exit_bb = BasicBlock::Create(TheContext, "exit", wrapper);
+
+    Builder.SetInsertPoint(entry_bb);
+    vector<Value *> column_ptrs;
+    for (unsigned i = 0; i < the_function->arg_size(); ++i)
+    {
+        column_ptrs.push_back(Builder.CreateLoad(
+            Builder.CreateConstInBoundsGEP1_32(double_ptr_ty, columns, i), "column"));
+    }
+    Builder.CreateBr(loop_bb);
+
+    Builder.SetInsertPoint(loop_bb);
+    auto i = Builder.CreatePHI(index_ty, 2, "i");
+    i->addIncoming(begin, entry_bb);
+    Builder.CreateCondBr(Builder.CreateICmpSLT(i, end), body_bb, exit_bb);
+
+    Builder.SetInsertPoint(body_bb);
+    vector<Value *> args;
+    for (auto column : column_ptrs)
+    {
+        args.push_back(Builder.CreateLoad(Builder.CreateInBoundsGEP(double_ty, column, i)));
+    }
+    auto call = Builder.CreateCall(the_function, args, "calltmp");
+    call->addAttribute(AttributeList::FunctionIndex, Attribute::AlwaysInline);
+    Builder.CreateStore(call, Builder.CreateInBoundsGEP(double_ty, out, i));
+    i->addIncoming(Builder.CreateNSWAdd(i, ConstantInt::get(index_ty, 1), "next"), body_bb);
+    Builder.CreateBr(loop_bb);
+
+    Builder.SetInsertPoint(exit_bb);
+    Builder.CreateRetVoid();
+    verifyFunction(*wrapper);
+}
+
 Value *NumberExprAST::codegen()
 {
     return ConstantFP::get(TheContext, APFloat(value_));
@@ -35,7 +212,7 @@ Value *VariableExprAST::codegen()
     auto V = NamedValues[name_];
     if (!V)
     {
-        log_error_v("Unknown variable name");
+        return log_error_v("Unknown variable name");
     }
     return Builder.CreateLoad(V, name_.c_str());
 }
@@ -110,6 +287,173 @@ Value *BinaryExprAST::codegen()
     return Builder.CreateCall(f, { lhs, rhs }, "binop");
 }
 
+// SpecializationBudget - most specialized copies compiled into one module
+constexpr size_t SpecializationBudget = 16;
+
+// can_specialize - whether the call at a site may go to a specialized copy.
+// Only hot sites qualify when there is a profile, and instrumented code is
+// never specialized. With indirection, a copy wouldn't follow a redefinition
+// of its callee, so the JIT only specializes calls from top-level
+// expressions, whose code is thrown away once they have run.
+bool can_specialize(size_t site)
+{
+    return Specialize && ProfileGenerate.empty()
+        && (!has_profile() || is_hot_call(site))
+        && (!Interpret || !Indirection || TheModule->getFunction("__anno_expr"));
+}
+
+// emit_specialization - compile the body of name into spec, binding each
+// constant of args to its parameter and each other argument to the next
+// parameter of spec
+bool emit_specialization(Function *spec, const string &name, const vector<Value *> &args)
+{
+    if (PureFunctions.count(name))
+    {
+        spec->addFnAttr(Attribute::ReadNone);
+        spec->addFnAttr(Attribute::NoUnwind);
+    }
+
+    auto ip = Builder.saveIP();
+    auto old_bindings = NamedValues;
+    auto profile = suspend_function_profile();
+
+    Builder.SetInsertPoint(BasicBlock::Create(TheContext, "entry", spec));
+    NamedValues.clear();
+    const auto &arg_names = FunctionProtos[name]->get_args();
+    auto param = spec->arg_begin();
+    for (size_t i = 0; i != args.size(); ++i)
+    {
+        auto alloca = create_entry_block_alloca(spec, arg_names[i]);
+        Builder.CreateStore(isa<ConstantFP>(args[i]) ? args[i] : &*param++, alloca);
+        NamedValues[arg_names[i]] = alloca;
+    }
+
+    auto ret_val = FunctionBodies[name]->codegen();
+    if (ret_val)
+    {
+        Builder.CreateRet(ret_val);
+        verifyFunction(*spec);
+    }
+
+    resume_function_profile(profile);
+    NamedValues = old_bindings;
+    Builder.restoreIP(ip);
+    return ret_val != nullptr;
+}
+
+// specialize - compile a copy of the callee into the current module with its
+// constant arguments folded in, so they reach its conditions and loop bounds,
+// and remove them from args. Copies are named after the callee and the bits
+// of each constant, so a recursive call passing the same constants on reuses
+// the copy being compiled. Returns nullptr if the callee's body is unknown or
+// the module has used up its budget.
+Function *specialize(const string &name, vector<Value *> &args)
+{
+    if (!FunctionBodies.count(name))
+    {
+        return nullptr;
+    }
+
+    string spec_name = name + ".spec";
+    vector<Type *> param_types;
+    for (auto arg : args)
+    {
+        if (auto constant = dyn_cast<ConstantFP>(arg))
+        {
+            spec_name += "." + utohexstr(constant->getValueAPF().bitcastToAPInt().getZExtValue());
+        }
+        else
+        {
+            spec_name += ".x";
+            param_types.push_back(arg->getType());
+        }
+    }
+
+    auto spec = TheModule->getFunction(spec_name);
+    if (!spec)
+    {
+        if (Specializations == SpecializationBudget)
+        {
+            return nullptr;
+        }
+        ++Specializations;
+
+        spec = Function::Create(FunctionType::get(Type::getDoubleTy(TheContext), param_types, false),
+            Function::InternalLinkage, spec_name, TheModule.get());
+        if (!emit_specialization(spec, name, args))
+        {
+            spec->eraseFromParent();
+            return nullptr;
+        }
+        SpecializedFunctions.add();
+    }
+
+    args.erase(remove_if(args.begin(), args.end(), [](Value *arg) { return isa<ConstantFP>(arg); }),
+        args.end());
+    return spec;
+}
+
+// respecialize - compile the copies of name in the current module again
+// from its new body, as their callers expect the redefined function. The
+// constants are read back from the names of the copies. A copy that fails to
+// compile becomes a call to the function with its constants.
+void respecialize(const string &name)
+{
+    auto prefix = name + ".spec.";
+    vector<Function *> copies;
+    for (auto &f : TheModule->functions())
+    {
+        if (f.getName().startswith(prefix))
+        {
+            copies.push_back(&f);
+        }
+    }
+
+    for (auto spec : copies)
+    {
+        SmallVector<StringRef, 4> fields;
+        spec->getName().drop_front(prefix.size()).split(fields, '.');
+        if (fields.size() != FunctionProtos[name]->get_args().size())
+        {
+            continue;
+        }
+
+        vector<Value *> args;
+        auto param = spec->arg_begin();
+        for (auto field : fields)
+        {
+            uint64_t bits;
+            if (field == "x")
+            {
+                args.push_back(&*param++);
+            }
+            else if (!field.getAsInteger(16, bits))
+            {
+                args.push_back(ConstantFP::get(TheContext, APFloat(APFloat::IEEEdouble(), APInt(64, bits))));
+            }
+        }
+        if (args.size() != fields.size() || param != spec->arg_end())
+        {
+            continue;
+        }
+
+        spec->deleteBody();
+        spec->setLinkage(Function::InternalLinkage);
+        spec->removeFnAttr(Attribute::ReadNone);
+        spec->removeFnAttr(Attribute::NoUnwind);
+        if (emit_specialization(spec, name, args))
+        {
+            continue;
+        }
+
+        // its callers still need it: make it call the function itself
+        spec->deleteBody();
+        spec->setLinkage(Function::InternalLinkage);
+        IRBuilder<> builder(BasicBlock::Create(TheContext, "entry", spec));
+        builder.CreateRet(builder.CreateCall(TheModule->getFunction(name), args));
+    }
+}
+
 Value *CallExprAST::codegen()
 {
     auto callee = get_function(callee_);
@@ -131,7 +475,22 @@ Value *CallExprAST::codegen()
             return nullptr;
         }
     }
-    return Builder.CreateCall(callee, args, "calltmp");
+
+    auto site = profile_site(1);
+    if (can_specialize(site) && any_of(args.begin(), args.end(), [](Value *arg) { return isa<ConstantFP>(arg); }))
+    {
+        if (auto spec = specialize(callee_, args))
+        {
+            callee = spec;
+        }
+    }
+    emit_profile_increment(site);
+    auto call = Builder.CreateCall(callee, args, "calltmp");
+    if (is_hot_call(site))
+    {
+        call->addAttribute(AttributeList::FunctionIndex, Attribute::AlwaysInline);
+    }
+    return call;
 }
 
 Value *IfExprAST::codegen()
@@ -150,9 +509,14 @@ Value *IfExprAST::codegen()
     auto else_bb = BasicBlock::Create(TheContext, "else");
     auto merge_bb = BasicBlock::Create(TheContext, "ifcont");
 
-    Builder.CreateCondBr(cond, then_bb, else_bb);
+    auto site = profile_site(2);
+    auto weights = has_profile()
+                 ? profile_branch_weights(profile_count(site), profile_count(site + 1))
+                 : nullptr;
+    Builder.CreateCondBr(cond, then_bb, else_bb, weights);
 
     Builder.SetInsertPoint(then_bb);
+    emit_profile_increment(site);
     auto then = then_->codegen();
     if (!then)
     {
@@ -163,6 +527,7 @@ Value *IfExprAST::codegen()
 
     the_function->getBasicBlockList().push_back(else_bb);
     Builder.SetInsertPoint(else_bb);
+    emit_profile_increment(site + 1);
 
     auto els = else_->codegen();
     if (!els)
@@ -181,26 +546,147 @@ Value *IfExprAST::codegen()
     return pn;
 }
 
-Value *ForExprAST::codegen()
+// MaxExactInteger - doubles hold every integer up to this magnitude
+constexpr double MaxExactInteger = 9007199254740992.0;
+
+bool is_exact_integer(double value)
 {
-    auto start = start_->codegen();
-    if (!start)
+    return value == floor(value) && fabs(value) <= MaxExactInteger;
+}
+
+// counted_bound - the bound of a loop `for v = start, v < bound, step` that
+// only visits integers, whose trip count can be computed before it starts:
+// start and step are integral constants, step is positive, and bound is a
+// constant or a variable which, like v, the body never assigns. Returns
+// nullptr for any other loop.
+ExprAST *ForExprAST::counted_bound(Value *start, double step)
+{
+    auto start_value = dyn_cast<ConstantFP>(start);
+    if (!start_value || !is_exact_integer(start_value->getValueAPF().convertToDouble())
+        || !(step >= 1) || !is_exact_integer(step))
+    {
+        return nullptr;
+    }
+
+    auto end = dynamic_cast<BinaryExprAST*>(end_.get());
+    if (!end || end->get_op() != '<')
+    {
+        return nullptr;
+    }
+    auto var = dynamic_cast<VariableExprAST*>(&end->get_lhs());
+    if (!var || var->get_name() != var_name_)
     {
         return nullptr;
     }
 
+    set<string> assigned;
+    body_->collect_assigned(assigned);
+    if (assigned.count(var_name_))
+    {
+        return nullptr;
+    }
+
+    auto &bound = end->get_rhs();
+    if (dynamic_cast<NumberExprAST*>(&bound))
+    {
+        return &bound;
+    }
+    auto bound_var = dynamic_cast<VariableExprAST*>(&bound);
+    if (bound_var && bound_var->get_name() != var_name_ && !assigned.count(bound_var->get_name()))
+    {
+        return &bound;
+    }
+    return nullptr;
+}
+
+// emit_counted_loop - emit a loop found by counted_bound as one counting its
+// iterations in an integer, with the bound evaluated once, so that SCEV sees
+// the trip count and the loop passes can unroll, vectorize and rewrite it
+bool ForExprAST::emit_counted_loop(AllocaInst *variable, Value *start, double step, ExprAST &bound)
+{
+    auto double_ty = Type::getDoubleTy(TheContext);
+    auto index_ty = Type::getInt64Ty(TheContext);
+
+    auto end = bound.codegen();
+    if (!end)
+    {
+        return false;
+    }
+
+    // an integer v is below end exactly when it is below ceil(end); the limit
+    // is clamped to the range of exact integers, and a NaN end, which never
+    // stops the loop, counts as the top of that range
+    auto max = ConstantFP::get(double_ty, MaxExactInteger);
+    auto ceil = Intrinsic::getDeclaration(TheModule.get(), Intrinsic::ceil, { double_ty });
+    Value *limit = Builder.CreateCall(ceil, { end });
+    limit = Builder.CreateSelect(Builder.CreateFCmpOLT(limit, max), limit, max);
+    limit = Builder.CreateSelect(Builder.CreateFCmpOGT(limit, ConstantFP::get(double_ty, -MaxExactInteger)),
+        limit, ConstantFP::get(double_ty, -MaxExactInteger));
+    limit = Builder.CreateFPToSI(limit, index_ty);
+
+    // the body runs for v = start, start + step, ... up to and including the
+    // first v which is not below the limit
+    auto first = ConstantInt::get(index_ty, static_cast<int64_t>(cast<ConstantFP>(start)->getValueAPF().convertToDouble()));
+    auto stride = ConstantInt::get(index_ty, static_cast<int64_t>(step));
+    auto span = Builder.CreateSub(limit, first);
+    auto last = Builder.CreateSDiv(Builder.CreateAdd(span, ConstantInt::get(index_ty, static_cast<int64_t>(step) - 1)), stride);
+    last = Builder.CreateSelect(Builder.CreateICmpSGT(span, ConstantInt::get(index_ty, 0)),
+        last, ConstantInt::get(index_ty, 0));
+    auto trip_count = Builder.CreateAdd(last, ConstantInt::get(index_ty, 1), "tripcount");
+
     auto the_function = Builder.GetInsertBlock()->getParent();
-    auto alloca = create_entry_block_alloca(the_function, var_name_);
-    Builder.CreateStore(start, alloca);
+    auto preheader_bb = Builder.GetInsertBlock();
+    auto loop_bb = BasicBlock::Create(TheContext, "loop", the_function);
+
+    auto site = profile_site(2);
+    emit_profile_increment(site);
+    Builder.CreateBr(loop_bb);
+    Builder.SetInsertPoint(loop_bb);
+    emit_profile_increment(site + 1);
+
+    auto index = Builder.CreatePHI(index_ty, 2, "index");
+    index->addIncoming(ConstantInt::get(index_ty, 0), preheader_bb);
+    Builder.CreateStore(Builder.CreateSIToFP(Builder.CreateAdd(first, Builder.CreateMul(index, stride)), double_ty),
+        variable);
+
+    if (!body_->codegen())
+    {
+        return false;
+    }
+
+    auto next_index = Builder.CreateAdd(index, ConstantInt::get(index_ty, 1), "nextindex");
+    index->addIncoming(next_index, Builder.GetInsertBlock());
+    auto end_cond = Builder.CreateICmpSLT(next_index, trip_count, "loopcond");
 
+    auto after_bb = BasicBlock::Create(TheContext, "afterloop", the_function);
+
+    MDNode *weights = nullptr;
+    if (has_profile())
+    {
+        auto entries = profile_count(site), iterations = profile_count(site + 1);
+        weights = profile_branch_weights(iterations - min(entries, iterations), entries);
+    }
+    Builder.CreateCondBr(end_cond, loop_bb, after_bb, weights);
+    Builder.SetInsertPoint(after_bb);
+    return true;
+}
+
+// emit_loop - emit any other loop, evaluating the body, step and end
+// condition in turn on every iteration
+bool ForExprAST::emit_loop(AllocaInst *variable)
+{
+    auto the_function = Builder.GetInsertBlock()->getParent();
     auto loop_bb = BasicBlock::Create(TheContext, "loop", the_function);
 
+    auto site = profile_site(2);
+    emit_profile_increment(site);
     Builder.CreateBr(loop_bb);
     Builder.SetInsertPoint(loop_bb);
+    emit_profile_increment(site + 1);
 
     if (!body_->codegen())
     {
-        return nullptr;
+        return false;
     }
 
     Value *step = nullptr;
@@ -209,7 +695,7 @@ Value *ForExprAST::codegen()
         step = step_->codegen();
         if (!step)
         {
-            return nullptr;
+            return false;
         }
     }
     else
@@ -220,22 +706,221 @@ Value *ForExprAST::codegen()
     auto end_cond = end_->codegen();
     if (!end_cond)
     {
-        return nullptr;
+        return false;
     }
 
-    auto cur_var = Builder.CreateLoad(alloca);
+    auto cur_var = Builder.CreateLoad(variable);
     auto next_var = Builder.CreateFAdd(cur_var, step, "nextvar");
-    Builder.CreateStore(next_var, alloca);
+    Builder.CreateStore(next_var, variable);
     end_cond = Builder.CreateFCmpONE(end_cond, ConstantFP::get(TheContext, APFloat(0.0)), "loopcond");
 
     auto after_bb = BasicBlock::Create(TheContext, "afterloop", the_function);
 
-    Builder.CreateCondBr(end_cond, loop_bb, after_bb);
+    MDNode *weights = nullptr;
+    if (has_profile())
+    {
+        auto entries = profile_count(site), iterations = profile_count(site + 1);
+        weights = profile_branch_weights(iterations - min(entries, iterations), entries);
+    }
+    Builder.CreateCondBr(end_cond, loop_bb, after_bb, weights);
     Builder.SetInsertPoint(after_bb);
+    return true;
+}
+
+Value *ForExprAST::codegen()
+{
+    auto start = start_->codegen();
+    if (!start)
+    {
+        return nullptr;
+    }
+
+    auto the_function = Builder.GetInsertBlock()->getParent();
+    auto alloca = create_entry_block_alloca(the_function, var_name_);
+    Builder.CreateStore(start, alloca);
+
+    // the loop variable shadows any variable of the same name in the body
+    auto old_val = NamedValues[var_name_];
+    NamedValues[var_name_] = alloca;
+
+    // a literal step is the same on every iteration
+    auto step = 1.0;
+    if (step_)
+    {
+        auto number = dynamic_cast<NumberExprAST*>(step_.get());
+        step = number ? number->get_value() : NAN;
+    }
+
+    auto bound = counted_bound(start, step);
+    if (!(bound ? emit_counted_loop(alloca, start, step, *bound) : emit_loop(alloca)))
+    {
+        return nullptr;
+    }
+
+    if (old_val)
+    {
+        NamedValues[var_name_] = old_val;
+    }
+    else
+    {
+        NamedValues.erase(var_name_);
+    }
 
     return Constant::getNullValue(Type::getDoubleTy(TheContext));
 }
 
+// emit_parfor_chunk - outline the body of a parfor into an internal
+// function chunk(env, begin, end, result) running iterations [begin, end).
+// env holds the start and step followed by the values of the captured
+// variables, which each chunk copies into variables of its own. The
+// combined value of the body is stored to *result.
+Function *emit_parfor_chunk(Function *parent, const string &var_name,
+    const vector<string> &captures, char reduce_op, ExprAST &body)
+{
+    auto double_ty = Type::getDoubleTy(TheContext);
+    auto double_ptr_ty = double_ty->getPointerTo();
+    auto index_ty = Type::getInt64Ty(TheContext);
+
+    auto chunk_ty = FunctionType::get(Type::getVoidTy(TheContext),
+        { double_ptr_ty, index_ty, index_ty, double_ptr_ty }, false);
+    auto chunk = Function::Create(chunk_ty, Function::InternalLinkage,
+        parent->getName() + ".parfor", TheModule.get());
+    auto arg = chunk->arg_begin();
+    Value *env = arg++, *begin = arg++, *end = arg++, *result = arg++;
+    env->setName("env");
+    begin->setName("begin");
+    end->setName("end");
+    result->setName("result");
+
+    auto entry_bb = BasicBlock::Create(TheContext, "entry", chunk);
+    auto loop_bb = BasicBlock::Create(TheContext, "loop", chunk);
+    auto body_bb = BasicBlock::Create(TheContext, "body", chunk);
+    auto exit_bb = BasicBlock::Create(TheContext, "exit", chunk);
+
+    Builder.SetInsertPoint(entry_bb);
+    auto start = Builder.CreateLoad(Builder.CreateConstInBoundsGEP1_32(double_ty, env, 0), "start");
+    auto step = Builder.CreateLoad(Builder.CreateConstInBoundsGEP1_32(double_ty, env, 1), "step");
+    NamedValues.clear();
+    for (size_t i = 0; i < captures.size(); ++i)
+    {
+        auto alloca = create_entry_block_alloca(chunk, captures[i]);
+        Builder.CreateStore(Builder.CreateLoad(
+            Builder.CreateConstInBoundsGEP1_32(double_ty, env, i + 2)), alloca);
+        NamedValues[captures[i]] = alloca;
+    }
+    auto var = create_entry_block_alloca(chunk, var_name);
+    NamedValues[var_name] = var;
+    Builder.CreateBr(loop_bb);
+
+    Builder.SetInsertPoint(loop_bb);
+    auto k = Builder.CreatePHI(index_ty, 2, "k");
+    k->addIncoming(begin, entry_bb);
+    PHINode *acc = nullptr;
+    if (reduce_op)
+    {
+        acc = Builder.CreatePHI(double_ty, 2, "acc");
+        acc->addIncoming(ConstantFP::get(double_ty, reduce_op == '*' ? 1.0 : 0.0), entry_bb);
+    }
+    Builder.CreateCondBr(Builder.CreateICmpSLT(k, end), body_bb, exit_bb);
+
+    Builder.SetInsertPoint(body_bb);
+    auto offset = Builder.CreateFMul(Builder.CreateSIToFP(k, double_ty), step);
+    Builder.CreateStore(Builder.CreateFAdd(start, offset, "i"), var);
+    auto value = body.codegen();
+    if (!value)
+    {
+        chunk->eraseFromParent();
+        return nullptr;
+    }
+    auto latch_bb = Builder.GetInsertBlock();
+    if (acc)
+    {
+        acc->addIncoming(reduce_op == '*' ? Builder.CreateFMul(acc, value, "acc.next")
+                                          : Builder.CreateFAdd(acc, value, "acc.next"), latch_bb);
+    }
+    k->addIncoming(Builder.CreateNSWAdd(k, ConstantInt::get(index_ty, 1), "k.next"), latch_bb);
+    Builder.CreateBr(loop_bb);
+
+    Builder.SetInsertPoint(exit_bb);
+    Builder.CreateStore(acc ? static_cast<Value *>(acc) : ConstantFP::get(double_ty, 0.0), result);
+    Builder.CreateRetVoid();
+    verifyFunction(*chunk);
+    return chunk;
+}
+
+Value *ParForExprAST::codegen()
+{
+    auto double_ty = Type::getDoubleTy(TheContext);
+    auto index_ty = Type::getInt64Ty(TheContext);
+    auto int_ty = Type::getInt32Ty(TheContext);
+
+    auto start = start_->codegen();
+    if (!start)
+    {
+        return nullptr;
+    }
+    auto end = end_->codegen();
+    if (!end)
+    {
+        return nullptr;
+    }
+    Value *step = ConstantFP::get(TheContext, APFloat(1.0));
+    if (step_ && !(step = step_->codegen()))
+    {
+        return nullptr;
+    }
+
+    // the body sees the values the variables in scope have when the loop
+    // starts; assignments to them stay private to a chunk
+    auto the_function = Builder.GetInsertBlock()->getParent();
+    vector<string> captures;
+    for (const auto &name_alloca : NamedValues)
+    {
+        if (name_alloca.second && name_alloca.first != var_name_)
+        {
+            captures.push_back(name_alloca.first);
+        }
+    }
+
+    IRBuilder<> tmp_b(&the_function->getEntryBlock(), the_function->getEntryBlock().begin());
+    auto env = tmp_b.CreateAlloca(double_ty, ConstantInt::get(int_ty, captures.size() + 2), "parfor.env");
+    Builder.CreateStore(start, Builder.CreateConstInBoundsGEP1_32(double_ty, env, 0));
+    Builder.CreateStore(step, Builder.CreateConstInBoundsGEP1_32(double_ty, env, 1));
+    for (size_t i = 0; i < captures.size(); ++i)
+    {
+        Builder.CreateStore(Builder.CreateLoad(NamedValues[captures[i]]),
+            Builder.CreateConstInBoundsGEP1_32(double_ty, env, i + 2));
+    }
+
+    // iterations run for i = start, start + step, ... as for a `for` loop
+    // testing i < end: up to the first value that isn't below end, at least
+    // once. A step that isn't positive and NaN bounds only run the first,
+    // and there are at most 2^53 more
+    auto span = Builder.CreateFDiv(Builder.CreateFSub(end, start), step);
+    auto counted = Builder.CreateAnd(Builder.CreateFCmpOGT(step, ConstantFP::get(double_ty, 0.0)),
+        Builder.CreateFCmpOGT(span, ConstantFP::get(double_ty, 0.0)));
+    span = Builder.CreateMinNum(span, ConstantFP::get(double_ty, MaxExactInteger));
+    auto ceil = Intrinsic::getDeclaration(TheModule.get(), Intrinsic::ceil, { double_ty });
+    auto last = Builder.CreateFPToSI(Builder.CreateCall(ceil, { span }), index_ty);
+    last = Builder.CreateSelect(counted, last, ConstantInt::get(index_ty, 0));
+    auto trip_count = Builder.CreateAdd(last, ConstantInt::get(index_ty, 1), "tripcount");
+
+    auto ip = Builder.saveIP();
+    auto old_bindings = NamedValues;
+    auto chunk = emit_parfor_chunk(the_function, var_name_, captures, reduce_op_, *body_);
+    NamedValues = old_bindings;
+    Builder.restoreIP(ip);
+    if (!chunk)
+    {
+        return nullptr;
+    }
+
+    auto op = reduce_op_ == '+' ? 1 : reduce_op_ == '*' ? 2 : 0;
+    auto parfor = TheModule->getOrInsertFunction("kaleidoscope_parfor",
+        double_ty, chunk->getType(), env->getType(), index_ty, int_ty);
+    return Builder.CreateCall(parfor, { chunk, env, trip_count, ConstantInt::get(int_ty, op) }, "parfor");
+}
+
 Value *VarExprAST::codegen()
 {
     auto old_bindings = NamedValues;
@@ -286,43 +971,73 @@ Function *PrototypeAST::codegen()
     {
         arg.setName(args_[idx++]);
     }
+    apply_effect_attributes(f);
+    apply_profile_attributes(f);
     return f;
 }
 
 Function *FunctionAST::codegen()
 {
+    ScopedTimer timer(CodegenTime);
     auto &proto = *proto_;
     FunctionProtos[proto.get_name()] = move(proto_);
+    FunctionBodies.erase(proto.get_name());
+
+    // a function is pure if it only calls pure functions or recurses into
+    // itself; variables are always local, so '=' can't touch outer state.
+    // With stubs, JIT'd callers keep their code and memo tables when a callee
+    // is redefined, so there only the libm routines are relied on
+    set<string> callees;
+    body_->collect_callees(callees);
+    auto is_pure = all_of(callees.begin(), callees.end(), [&](const string &callee)
+    {
+        return callee == proto.get_name()
+            || (PureFunctions.count(callee) && (!Interpret || !Indirection || LibmFunctions.count(callee)));
+    });
+    for (auto &callee : callees)
+    {
+        if (callee != proto.get_name())
+        {
+            Callers[callee].insert(proto.get_name());
+        }
+    }
+    // only a recursive function calling nothing but the libm routines is
+    // memoized, as no redefinition can make its cached results stale. Its
+    // memo table is memory it writes, so it and its callers aren't readnone
+    auto memoized = Memoize && is_pure && callees.count(proto.get_name()) && !proto.get_args().empty()
+        && all_of(callees.begin(), callees.end(), [&](const string &callee)
+        {
+            return callee == proto.get_name() || LibmFunctions.count(callee);
+        });
+    if (is_pure && !memoized)
+    {
+        PureFunctions.insert(proto.get_name());
+    }
+    else if (PureFunctions.erase(proto.get_name()))
+    {
+        drop_purity(proto.get_name());
+    }
+
     auto the_function = get_function(proto.get_name());
 
     if (!the_function)
     {
         return nullptr;
     }
-    else if (!the_function->empty())
+    // a redefinition in the same module also recompiles the function's
+    // specialized copies
+    auto redefined = !the_function->empty();
+    if (redefined)
     {
         the_function->getBasicBlockList().clear();
     }
+    apply_effect_attributes(the_function);
+    apply_profile_attributes(the_function);
+    begin_function_profile(the_function);
 
     if (proto.is_binary_op())
     {
-        auto op = proto.get_operator_name();
-        auto precedence = proto.get_binary_precedence();
-        if (Parser::symbol_precedences_.count(op)
-            && Parser::symbol_precedences_[op] != precedence)
-        {
-            Parser::precedence_symbols_[Parser::symbol_precedences_[op]].erase(op);
-        }
-        Parser::symbol_precedences_[op] = precedence;
-        auto pos = lower_bound(Parser::precedences_.begin(),
-            Parser::precedences_.end(),
-            precedence);
-        if (pos == Parser::precedences_.end()
-            || *pos != precedence)
-        {
-            Parser::precedences_.insert(pos, precedence);
-        }
-        Parser::precedence_symbols_[precedence].insert(proto.get_operator_name());
+        Parser::set_binary_precedence(proto.get_operator_name(), proto.get_binary_precedence());
     }
 
     auto bb = BasicBlock::Create(TheContext, "entry", the_function);
@@ -336,15 +1051,42 @@ Function *FunctionAST::codegen()
         NamedValues[arg.getName()] = alloca;
     }
 
+    pair<Value *, Value *> memo { nullptr, nullptr };
+    if (memoized)
+    {
+        memo = emit_memo_lookup(the_function);
+    }
+
     if (auto ret_val = body_->codegen())
     {
+        if (memo.first)
+        {
+            emit_memo_store(memo.first, memo.second, ret_val);
+        }
         Builder.CreateRet(ret_val);
+        end_function_profile(the_function);
         verifyFunction(*the_function);
-        TheFPM->run(*the_function);
+        if (Batch && proto.get_name() != "__anno_expr")
+        {
+            emit_batch_wrapper(the_function);
+        }
+        if (StatsOutput != StatsFormat::None)
+        {
+            IRInstructions.add(the_function->getInstructionCount());
+        }
+        if (Specialize && proto.get_name() != "__anno_expr")
+        {
+            FunctionBodies[proto.get_name()] = move(body_);
+            if (redefined)
+            {
+                respecialize(proto.get_name());
+            }
+        }
         return the_function;
     }
 
     the_function->eraseFromParent();
+    end_function_profile(nullptr);
     return nullptr;
 }
 } // namespace kaleidoscope
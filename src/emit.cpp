@@ -0,0 +1,252 @@
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "node.hpp"
+#include "emit.hpp"
+#include "stats.hpp"
+#include "optimizer.hpp"
+#include "llvm/Bitcode/BitcodeWriterPass.h"
+#include "llvm/IR/IRPrintingPasses.h"
+#include "llvm/Object/ArchiveWriter.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+
+using namespace std;
+using namespace llvm;
+using namespace kaleidoscope;
+
+namespace
+{
+TargetMachine *StreamTarget;
+string StreamOutput;
+vector<string> StreamObjects;
+size_t StreamDefinitions;
+bool StreamFailed;
+// functions defined by the objects written so far
+set<string> StreamDefined;
+// name the newest top-level expression got in an earlier object
+string StreamEntry;
+
+bool is_archive(const string &file)
+{
+    return sys::path::extension(file) == ".a";
+}
+
+// write_chunk - write the module to the next object and start a new one.
+// The newest top-level expression is the entry point, as in a single
+// module, whichever object it is in: earlier objects keep theirs under a
+// name of its own, and the last object gets an __anno_expr calling the
+// newest one if it has none.
+void write_chunk(bool last)
+{
+    if (auto anno_expr = TheModule->getFunction("__anno_expr"))
+    {
+        if (!last)
+        {
+            anno_expr->setName("__anno_expr." + to_string(StreamObjects.size()));
+            StreamEntry = anno_expr->getName().str();
+        }
+    }
+    else if (last && !StreamEntry.empty())
+    {
+        auto ft = FunctionType::get(Type::getDoubleTy(TheContext), false);
+        auto entry = Function::Create(ft, Function::ExternalLinkage, StreamEntry, TheModule.get());
+        auto anno_expr = Function::Create(ft, Function::ExternalLinkage, "__anno_expr", TheModule.get());
+        IRBuilder<> builder(BasicBlock::Create(TheContext, "entry", anno_expr));
+        builder.CreateRet(builder.CreateCall(entry));
+    }
+
+    for (auto &f : TheModule->functions())
+    {
+        if (!f.isDeclaration() && !f.hasLocalLinkage())
+        {
+            StreamDefined.insert(f.getName().str());
+        }
+    }
+
+    SmallString<128> file(StreamOutput);
+    auto extension = sys::path::extension(StreamOutput).str();
+    sys::path::replace_extension(file, "." + to_string(StreamObjects.size())
+        + (is_archive(StreamOutput) || extension.empty() ? ".o"s : extension));
+    StreamObjects.push_back(file.str().str());
+
+    if (!emit_object(*TheModule, StreamTarget, StreamObjects.back()))
+    {
+        StreamFailed = true;
+    }
+    ObjectFiles.add();
+    StreamDefinitions = 0;
+    initialize_module();
+}
+} // namespace
+
+namespace kaleidoscope
+{
+TargetMachine *create_target_machine(bool pic)
+{
+    InitializeAllTargetInfos();
+    InitializeAllTargets();
+    InitializeAllTargetMCs();
+    InitializeAllAsmParsers();
+    InitializeAllAsmPrinters();
+
+    auto target_triple = sys::getDefaultTargetTriple();
+
+    string error;
+    auto target = TargetRegistry::lookupTarget(target_triple, error);
+
+    if (!target)
+    {
+        errs() << error;
+        return nullptr;
+    }
+
+    auto cpu = "generic"s;
+    auto features = "";
+
+    TargetOptions opt;
+    auto rm = pic ? Optional<Reloc::Model>(Reloc::PIC_) : Optional<Reloc::Model>();
+    return target->createTargetMachine(target_triple, cpu, features, opt, rm);
+}
+
+bool set_emit_kind(const string &name)
+{
+    static const map<string, EmitKind> kinds
+    {
+        { "obj", EmitKind::Object },
+        { "asm", EmitKind::Assembly },
+        { "bc",  EmitKind::Bitcode },
+        { "ll",  EmitKind::IR },
+    };
+    auto it = kinds.find(name);
+    if (it == kinds.end())
+    {
+        return false;
+    }
+    Emit = it->second;
+    return true;
+}
+
+bool emit_object(Module &module, TargetMachine *target_machine, const string &file)
+{
+    module.setTargetTriple(target_machine->getTargetTriple().str());
+    module.setDataLayout(target_machine->createDataLayout());
+    optimize_module(module, target_machine, Emit == EmitKind::Bitcode);
+
+    std::error_code ec;
+    raw_fd_ostream dest(file, ec, sys::fs::OF_None);
+
+    if (ec)
+    {
+        errs() << "Could not open file: " << ec.message();
+        return false;
+    }
+
+    legacy::PassManager pass;
+    auto file_type = Emit == EmitKind::Assembly ? TargetMachine::CGFT_AssemblyFile
+                                                : TargetMachine::CGFT_ObjectFile;
+
+    if (Emit == EmitKind::Bitcode)
+    {
+        pass.add(createBitcodeWriterPass(dest));
+    }
+    else if (Emit == EmitKind::IR)
+    {
+        pass.add(createPrintModulePass(dest));
+    }
+    else if (target_machine->addPassesToEmitFile(pass, dest, nullptr, file_type))
+    {
+        errs() << "The target machine can't emit a file of this type";
+        return false;
+    }
+
+    {
+        ScopedTimer timer(EmitTime);
+        pass.run(module);
+        dest.flush();
+    }
+    ObjectBytes.add(dest.tell());
+
+    return true;
+}
+
+bool link_shared_library(const string &object, const string &file)
+{
+    auto driver = sys::findProgramByName("cc");
+    if (!driver)
+    {
+        errs() << "Could not find cc to link " << file << "\n";
+        return false;
+    }
+
+    StringRef args[] = { *driver, "-shared", "-o", file, object };
+    string error;
+    if (sys::ExecuteAndWait(*driver, args, None, {}, 0, 0, &error))
+    {
+        errs() << "Could not link " << file << (error.empty() ? "" : ": ") << error << "\n";
+        return false;
+    }
+    return true;
+}
+
+void begin_stream(TargetMachine *target_machine, const string &output)
+{
+    StreamTarget = target_machine;
+    StreamOutput = output;
+    StreamObjects.clear();
+    StreamDefinitions = 0;
+    StreamFailed = false;
+    StreamDefined.clear();
+    StreamEntry.clear();
+}
+
+void stream_definition(const string &name)
+{
+    // the objects would be linked with both definitions
+    if (StreamDefined.count(name))
+    {
+        log_error(("redefinition of " + name + ", already written to an earlier object").c_str());
+    }
+    if (++StreamDefinitions >= StreamChunk)
+    {
+        write_chunk(false);
+    }
+}
+
+bool end_stream()
+{
+    if (StreamDefinitions || TheModule->getFunction("__anno_expr") || !StreamEntry.empty() || StreamObjects.empty())
+    {
+        write_chunk(true);
+    }
+    if (StreamFailed || !is_archive(StreamOutput))
+    {
+        return !StreamFailed;
+    }
+
+    vector<NewArchiveMember> members;
+    for (auto &object : StreamObjects)
+    {
+        auto member = NewArchiveMember::getFile(object, true);
+        if (!member)
+        {
+            errs() << "Could not read " << object << ": " << toString(member.takeError()) << "\n";
+            return false;
+        }
+        members.push_back(move(*member));
+    }
+    auto kind = StreamTarget->getTargetTriple().isOSDarwin() ? object::Archive::K_DARWIN : object::Archive::K_GNU;
+    if (auto error = writeArchive(StreamOutput, members, true, kind, true, false))
+    {
+        errs() << "Could not write " << StreamOutput << ": " << toString(move(error)) << "\n";
+        return false;
+    }
+    for (auto &object : StreamObjects)
+    {
+        sys::fs::remove(object);
+    }
+    return true;
+}
+} // namespace kaleidoscope
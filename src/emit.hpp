@@ -0,0 +1,54 @@
+#ifndef KALEIDOSCOPE_EMIT_HPP
+#define KALEIDOSCOPE_EMIT_HPP
+
+#include <string>
+
+#include "llvm/IR/Module.h"
+#include "llvm/Target/TargetMachine.h"
+
+namespace kaleidoscope
+{
+// create_target_machine - target machine for the host, or nullptr after
+// printing why there is none
+llvm::TargetMachine *create_target_machine(bool pic = false);
+
+// EmitKind - what emit_object writes, chosen with --emit
+enum class EmitKind
+{
+    Object,
+    Assembly,
+    Bitcode,
+    IR
+};
+inline thread_local EmitKind Emit = EmitKind::Object;
+
+// set_emit_kind - select obj, asm, bc or ll, returns false if the name is
+// unknown
+bool set_emit_kind(const std::string &name);
+
+// emit_object - optimize the module and write it to a file of the kind
+// selected by Emit; bitcode is only optimized up to link-time optimization
+bool emit_object(llvm::Module &module, llvm::TargetMachine *target_machine, const std::string &file);
+
+// link_shared_library - link an object into a shared library with the
+// system compiler driver
+bool link_shared_library(const std::string &object, const std::string &file);
+
+// StreamChunk - with --stream, the number of definitions compiled into each
+// object file, after which the module is written and its IR released; 0
+// compiles the whole input into one module
+inline thread_local size_t StreamChunk;
+
+// begin_stream - start a streamed compilation. The objects are named after
+// output, a.o becoming a.0.o, a.1.o, ..., or if output ends in .a are
+// bundled into that archive by end_stream.
+void begin_stream(llvm::TargetMachine *target_machine, const std::string &output);
+// stream_definition - count a compiled definition of name, writing the
+// module out once it holds StreamChunk of them. Redefining a function of an
+// object already written is an error.
+void stream_definition(const std::string &name);
+// end_stream - write out the rest; false if any object couldn't be written
+bool end_stream();
+} // namespace kaleidoscope
+
+#endif // KALEIDOSCOPE_EMIT_HPP
@@ -0,0 +1,191 @@
+#include <cmath>
+#include <mutex>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <future>
+#include <thread>
+#include <condition_variable>
+
+#include "node.hpp"
+#include "builtin.hpp"
+#include "parser.hpp"
+#include "kaleidoscope.hpp"
+
+using namespace std;
+using namespace llvm;
+
+namespace kaleidoscope
+{
+// Session::Worker - the thread owning the compiler state of a session, all
+// of which is thread_local
+class Session::Worker
+{
+  public:
+    explicit Worker(bool batch) : batch_(batch), thread_([this] { main(); }) {}
+
+    ~Worker()
+    {
+        {
+            lock_guard<mutex> lock(mutex_);
+            stop_ = true;
+        }
+        ready_.notify_one();
+        thread_.join();
+    }
+
+    // run - call f on the worker thread and wait for its result
+    template <typename F>
+    auto run(F f) -> decltype(f())
+    {
+        packaged_task<decltype(f())()> task(move(f));
+        auto result = task.get_future();
+        {
+            lock_guard<mutex> lock(mutex_);
+            tasks_.emplace_back([&task] { task(); });
+        }
+        ready_.notify_one();
+        return result.get();
+    }
+
+    // compile - parse and compile source, collecting the errors it reports
+    bool compile(const string &source, double *value = nullptr)
+    {
+        errors_.clear();
+        ErrorLog = &errors_;
+        auto errors = ErrorCount;
+
+        Parser parser(source);
+        parser.main_loop();
+
+        ErrorLog = nullptr;
+        if (value)
+        {
+            *value = parser.last_value();
+        }
+        return ErrorCount == errors;
+    }
+
+    string errors_;
+    Handle compiles_ = 0;
+
+  private:
+    void main()
+    {
+        static std::once_flag initialized;
+        std::call_once(initialized, []
+        {
+            InitializeNativeTarget();
+            InitializeNativeTargetAsmPrinter();
+            InitializeNativeTargetAsmParser();
+        });
+
+        Interpret = true;
+        Batch = batch_;
+        // functions handed out by lookup run on the caller's threads while
+        // later sources are linked here
+        TheJIT = llvm::make_unique<orc::KaleidoscopeJIT>(Indirection, true);
+        initialize_module();
+
+        while (true)
+        {
+            function<void()> task;
+            {
+                unique_lock<mutex> lock(mutex_);
+                ready_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+                if (tasks_.empty())
+                {
+                    break;
+                }
+                task = move(tasks_.front());
+                tasks_.pop_front();
+            }
+            task();
+        }
+
+        // the code and the IR go before the context they were built in,
+        // after the profiles kept in the code's memory are written
+        kaleidoscope_write_profiles();
+        FunctionProtos.clear();
+        FunctionBodies.clear();
+        TheModule.reset();
+        TheJIT.reset();
+    }
+
+    mutex mutex_;
+    condition_variable ready_;
+    deque<function<void()>> tasks_;
+    bool stop_ = false;
+    bool batch_;
+    thread thread_;
+};
+
+Session::Session(bool batch) : worker_(std::make_unique<Worker>(batch))
+{
+    // ...
+}
+
+Session::~Session() = default;
+
+Session::Handle Session::compile(const string &source)
+{
+    return worker_->run([&]
+    {
+        return worker_->compile(source) ? ++worker_->compiles_ : 0;
+    });
+}
+
+void *Session::lookup(const string &name)
+{
+    return worker_->run([&]() -> void *
+    {
+        auto symbol = TheJIT->findSymbol(name);
+        if (!symbol)
+        {
+            return nullptr;
+        }
+        auto address = symbol.getAddress();
+        if (!address)
+        {
+            consumeError(address.takeError());
+            return nullptr;
+        }
+        return reinterpret_cast<void *>(*address);
+    });
+}
+
+double Session::evaluate(const string &source)
+{
+    return worker_->run([&]
+    {
+        double value;
+        return worker_->compile(source, &value) ? value : NAN;
+    });
+}
+
+Session::BatchFunction Session::lookup_batch(const string &name)
+{
+    return reinterpret_cast<BatchFunction>(lookup(name + "_batch"));
+}
+
+void Session::evaluate_batch(BatchFunction f, const double *const *columns, double *out,
+    size_t n, unsigned threads)
+{
+    threads = max(1u, min<unsigned>(threads, n / 1024 + 1));
+    vector<thread> workers;
+    for (unsigned t = 1; t < threads; ++t)
+    {
+        workers.emplace_back(f, columns, out, n * t / threads, n * (t + 1) / threads);
+    }
+    f(columns, out, 0, n / threads);
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+string Session::errors() const
+{
+    return worker_->run([&] { return worker_->errors_; });
+}
+} // namespace kaleidoscope
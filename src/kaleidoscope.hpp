@@ -0,0 +1,64 @@
+#ifndef KALEIDOSCOPE_KALEIDOSCOPE_HPP
+#define KALEIDOSCOPE_KALEIDOSCOPE_HPP
+
+#include <memory>
+#include <string>
+#include <cstdint>
+
+// Embedding API of libkaleidoscope. Programs using it must export the
+// runtime functions (putchard, printd, ...) to the JIT, so link the whole
+// library and export its symbols:
+//
+//   -Wl,--whole-archive libkaleidoscope.a -Wl,--no-whole-archive -rdynamic
+namespace kaleidoscope
+{
+// Session - a compiler and JIT of its own. Sessions share no state, so
+// different sessions can be used concurrently from different threads; the
+// calls on one session are serialized.
+class Session
+{
+  public:
+    // Handle - identifies a successful compile, 0 if it failed
+    using Handle = size_t;
+
+    // BatchFunction - <f>_batch, which sets out[i] = f(columns[0][i], ...)
+    // for i in [begin, end)
+    using BatchFunction = void (*)(const double *const *columns, double *out, int64_t begin, int64_t end);
+
+    // with batch, every definition also gets a batch function
+    explicit Session(bool batch = false);
+    ~Session();
+
+    Session(const Session &) = delete;
+    Session &operator=(const Session &) = delete;
+
+    // compile - compile the definitions and externs of source, and run its
+    // top-level expressions
+    Handle compile(const std::string &source);
+
+    // lookup - address of a compiled function, or nullptr; the function can
+    // be called from any thread
+    void *lookup(const std::string &name);
+
+    // evaluate - value of the last top-level expression of source, NaN if it
+    // failed to compile
+    double evaluate(const std::string &source);
+
+    // lookup_batch - the batch function of a definition, or nullptr
+    BatchFunction lookup_batch(const std::string &name);
+
+    // evaluate_batch - run a batch function over n rows, splitting them
+    // across threads
+    static void evaluate_batch(BatchFunction f, const double *const *columns, double *out,
+        size_t n, unsigned threads = 1);
+
+    // errors - errors reported by the last compile or evaluate
+    std::string errors() const;
+
+  private:
+    class Worker;
+    std::unique_ptr<Worker> worker_;
+};
+} // namespace kaleidoscope
+
+#endif // KALEIDOSCOPE_KALEIDOSCOPE_HPP
@@ -1,8 +1,10 @@
 #include <cctype>
+#include <cstdio>
 #include <utility>
 #include <unordered_map>
 
 #include "lexer.hpp"
+#include "stats.hpp"
 
 using namespace std;
 
@@ -20,7 +22,9 @@ const unordered_map<string, Token::Type> symbols
     { "in",     Token::IN },
     { "binary", Token::BINARY },
     { "unary",  Token::UNARY },
-    { "var",    Token::VAR }
+    { "var",    Token::VAR },
+    { "parfor", Token::PARFOR },
+    { "reduce", Token::REDUCE }
 };
 } // namespace
 
@@ -48,12 +52,43 @@ string Token::value() const
 }
 
 Lexer::Lexer()
-  : last_char_(' ')
+  : last_char_(' '), from_source_(false), pos_(0)
 {
     // ...
 }
 
+Lexer::Lexer(string source)
+  : last_char_(' '), from_source_(true), source_(move(source)), pos_(0)
+{
+    // ...
+}
+
+int Lexer::get()
+{
+    if (!from_source_)
+    {
+        return getchar();
+    }
+    return pos_ < source_.size() ? (unsigned char)source_[pos_++] : EOF;
+}
+
 Token Lexer::next()
+{
+    ScopedTimer timer(LexTime);
+    Tokens.add();
+    return lex();
+}
+
+bool Lexer::at_end_of_line()
+{
+    while (last_char_ == ' ' || last_char_ == '\t')
+    {
+        last_char_ = get();
+    }
+    return last_char_ == '\n' || last_char_ == '\r' || last_char_ == '#' || last_char_ == EOF;
+}
+
+Token Lexer::lex()
 {
     string value;
 
@@ -67,13 +102,13 @@ Token Lexer::next()
 
     while (isspace(last_char_))
     {
-        last_char_ = getchar();
+        last_char_ = get();
     }
 
     if (isalpha(last_char_)) // identifier: [a-zA-Z][a-zA-Z0-9]*
     {
         value = last_char_;
-        while (isalnum((last_char_ = getchar())))
+        while (isalnum((last_char_ = get())))
         {
             value += last_char_;
         }
@@ -87,25 +122,34 @@ Token Lexer::next()
         }
 
     }
-    else if (isdigit(last_char_) || last_char_ == '.') // Number: [0-9.]+
+    else if (isdigit(last_char_) || last_char_ == '.') // Number: [0-9]+(\.[0-9]*)?|\.[0-9]+
     {
+        // take the whole run of digits and points, so that 1.2.3 is one
+        // malformed literal rather than 1.2 followed by .3
+        size_t points = 0;
         do
         {
+            points += last_char_ == '.';
             value += last_char_;
-            last_char_ = getchar();
+            last_char_ = get();
         } while (isdigit(last_char_) || last_char_ == '.');
-        return Token(Token::NUMBER, value);
+
+        if (value == ".")
+        {
+            return Token('.');
+        }
+        return Token(points > 1 ? Token::INVALID : Token::NUMBER, value);
     }
     else if (last_char_ == '#')
     {
         do
         {
-            last_char_ = getchar();
+            last_char_ = get();
         } while (last_char_ != EOF && last_char_ != '\n' && last_char_ != '\r');
 
         if (last_char_ != EOF)
         {
-            return next();
+            return lex();
         }
     }
 
@@ -116,7 +160,7 @@ Token Lexer::next()
     else
     {
         int this_char = last_char_;
-        last_char_ = getchar();
+        last_char_ = get();
         return Token(this_char);
     }
 }
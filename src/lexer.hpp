@@ -33,6 +33,13 @@ class Token
 
         // var definition
         VAR         = -13,
+
+        // parallel loop
+        PARFOR      = -14,
+        REDUCE      = -15,
+
+        // malformed number literal, e.g. 1.2.3
+        INVALID     = -16,
     };
 
     Token() = default;
@@ -56,12 +63,23 @@ class Token
 class Lexer
 {
   public:
+    // read stdin, or the given source
     Lexer();
+    explicit Lexer(std::string source);
 
     Token next();
+    // at_end_of_line - whether only blanks or a comment follow the last
+    // token on its line; reads no further than that line
+    bool at_end_of_line();
 
   private:
+    Token lex();
+    int get();
+
     char last_char_;
+    bool from_source_;
+    std::string source_;
+    size_t pos_;
 };
 } // namespace kaleidoscope
 
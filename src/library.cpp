@@ -0,0 +1,126 @@
+#include <string>
+#include <vector>
+#include <sstream>
+
+#include "node.hpp"
+#include "library.hpp"
+#include "session.hpp"
+#include "llvm/ADT/Triple.h"
+#include "llvm/IR/Mangler.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+using namespace std;
+using namespace llvm;
+
+// The interface is the text written by write_interface followed by
+//
+//   symbols <n> <mangled symbols...>
+namespace
+{
+const char *SectionName = ".kaleidoscope";
+const char *MachOSectionName = "__DATA,__kaleidoscope";
+} // namespace
+
+namespace kaleidoscope
+{
+void embed_library_interface(Module &module)
+{
+    ostringstream out;
+    write_interface(out);
+
+    vector<string> symbols;
+    for (auto &gv : module.global_values())
+    {
+        if (gv.isDeclaration() || gv.hasLocalLinkage())
+        {
+            continue;
+        }
+        string symbol;
+        raw_string_ostream symbol_stream(symbol);
+        Mangler::getNameWithPrefix(symbol_stream, gv.getName(), module.getDataLayout());
+        symbols.push_back(symbol_stream.str());
+    }
+    out << "symbols " << symbols.size();
+    for (auto &symbol : symbols)
+    {
+        out << ' ' << symbol;
+    }
+    out << '\n';
+
+    auto init = ConstantDataArray::getString(TheContext, out.str(), false);
+    auto gv = new GlobalVariable(module, init->getType(), true,
+        GlobalValue::PrivateLinkage, init, "kaleidoscope.interface");
+    gv->setSection(Triple(module.getTargetTriple()).isOSBinFormatMachO()
+        ? MachOSectionName
+        : SectionName);
+    appendToUsed(module, { gv });
+}
+
+bool load_library(const string &file)
+{
+    auto buffer = MemoryBuffer::getFile(file);
+    if (!buffer)
+    {
+        fprintf(stderr, "Could not read library: %s\n", file.c_str());
+        return false;
+    }
+
+    auto object = object::ObjectFile::createObjectFile((*buffer)->getMemBufferRef());
+    if (!object)
+    {
+        consumeError(object.takeError());
+        fprintf(stderr, "Not an object file: %s\n", file.c_str());
+        return false;
+    }
+
+    string interface;
+    for (auto &section : (*object)->sections())
+    {
+        auto name = section.getName();
+        if (!name)
+        {
+            consumeError(name.takeError());
+            continue;
+        }
+        if (*name != SectionName && *name != "__kaleidoscope")
+        {
+            continue;
+        }
+        auto contents = section.getContents();
+        if (!contents)
+        {
+            consumeError(contents.takeError());
+            break;
+        }
+        interface = contents->str();
+        break;
+    }
+    if (interface.empty())
+    {
+        fprintf(stderr, "Not a Kaleidoscope library: %s\n", file.c_str());
+        return false;
+    }
+
+    istringstream in(interface);
+    string section;
+    size_t num_symbols = 0;
+    if (!read_interface(in) || !(in >> section >> num_symbols))
+    {
+        fprintf(stderr, "Corrupt library interface: %s\n", file.c_str());
+        return false;
+    }
+    vector<string> symbols(num_symbols);
+    for (auto &symbol : symbols)
+    {
+        in >> symbol;
+    }
+
+    if (Interpret)
+    {
+        TheJIT->addObject(move(*buffer), move(symbols));
+    }
+    return true;
+}
+} // namespace kaleidoscope
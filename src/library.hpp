@@ -0,0 +1,21 @@
+#ifndef KALEIDOSCOPE_LIBRARY_HPP
+#define KALEIDOSCOPE_LIBRARY_HPP
+
+#include <string>
+
+#include "llvm/IR/Module.h"
+
+namespace kaleidoscope
+{
+// embed_library_interface - store the interface of everything defined so
+// far, and the symbols the module defines, in a section of the object
+// compiled from it, turning the object into a library usable by --prelude
+void embed_library_interface(llvm::Module &module);
+
+// load_library - declare everything a library defines; in the REPL its
+// code is linked into the JIT too, when compiling the library object has
+// to be linked with the output
+bool load_library(const std::string &file);
+} // namespace kaleidoscope
+
+#endif // KALEIDOSCOPE_LIBRARY_HPP
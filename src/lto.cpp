@@ -0,0 +1,97 @@
+#include <set>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <algorithm>
+
+#include "node.hpp"
+#include "lto.hpp"
+#include "parser.hpp"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Transforms/IPO/Internalize.h"
+
+using namespace std;
+using namespace llvm;
+
+namespace
+{
+// called_elsewhere - whether anything but f itself refers to f
+bool called_elsewhere(const Function &f)
+{
+    return any_of(f.users().begin(), f.users().end(), [&](const User *user)
+    {
+        auto inst = dyn_cast<Instruction>(user);
+        return !inst || inst->getFunction() != &f;
+    });
+}
+} // namespace
+
+namespace kaleidoscope
+{
+bool link_program(const vector<string> &sources, const set<string> &exports)
+{
+    auto program = llvm::make_unique<Module>("program", TheContext);
+    Linker linker(*program);
+
+    for (size_t i = 0; i < sources.size(); ++i)
+    {
+        if (!freopen(sources[i].c_str(), "r", stdin))
+        {
+            fprintf(stderr, "Could not read %s\n", sources[i].c_str());
+            return false;
+        }
+        initialize_module();
+        Parser().main_loop();
+
+        // a later definition replaces an earlier one, including the
+        // top-level expression, as if the files were one
+        for (auto &f : TheModule->functions())
+        {
+            if (f.isDeclaration() || f.hasLocalLinkage())
+            {
+                continue;
+            }
+            auto earlier = program->getFunction(f.getName());
+            if (earlier && !earlier->isDeclaration())
+            {
+                earlier->deleteBody();
+            }
+        }
+        if (linker.linkInModule(move(TheModule)))
+        {
+            fprintf(stderr, "Could not link %s\n", sources[i].c_str());
+            return false;
+        }
+    }
+
+    // callers in earlier files of a function a later one redefined with
+    // side effects are no longer pure, nor are their specialized copies
+    for (auto &f : program->functions())
+    {
+        if (!f.isIntrinsic() && !PureFunctions.count(f.getName().split(".spec.").first.str()))
+        {
+            f.removeFnAttr(Attribute::ReadNone);
+            f.removeFnAttr(Attribute::NoUnwind);
+        }
+    }
+
+    set<string> keep = exports;
+    if (keep.empty())
+    {
+        for (auto &f : program->functions())
+        {
+            if (!f.isDeclaration() && !called_elsewhere(f))
+            {
+                keep.insert(f.getName().str());
+            }
+        }
+    }
+    internalizeModule(*program, [&](const GlobalValue &gv)
+    {
+        return keep.count(gv.getName().str()) > 0;
+    });
+
+    TheModule = move(program);
+    return true;
+}
+} // namespace kaleidoscope
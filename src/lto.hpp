@@ -0,0 +1,18 @@
+#ifndef KALEIDOSCOPE_LTO_HPP
+#define KALEIDOSCOPE_LTO_HPP
+
+#include <set>
+#include <string>
+#include <vector>
+
+namespace kaleidoscope
+{
+// link_program - compile the sources in order, each seeing what the ones
+// before it define, and link them into TheModule. Everything but the
+// exports is then internalized, so that the optimizer can inline it across
+// files and drop what is left unused. Without exports, the functions no
+// other function calls are kept.
+bool link_program(const std::vector<std::string> &sources, const std::set<std::string> &exports);
+} // namespace kaleidoscope
+
+#endif // KALEIDOSCOPE_LTO_HPP
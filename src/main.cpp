@@ -1,9 +1,22 @@
+#include <set>
 #include <tuple>
+#include <string>
+#include <vector>
 #include <iostream>
 
 #include "node.hpp"
+#include "stats.hpp"
 #include "lexer.hpp"
 #include "parser.hpp"
+#include "profile.hpp"
+#include "session.hpp"
+#include "library.hpp"
+#include "emit.hpp"
+#include "build.hpp"
+#include "lto.hpp"
+#include "parallel.hpp"
+#include "optimizer.hpp"
+#include "builtin.hpp"
 #include "argparse.hpp"
 
 using namespace std;
@@ -12,81 +25,164 @@ using namespace kaleidoscope;
 
 tuple<bool, string, string> args_parse(int argc, char *agrv[]);
 
+namespace
+{
+string SaveSession, LoadSession, Prelude, BuildDir;
+bool Library, Pipeline, Shared;
+size_t Jobs = 1;
+vector<string> LinkSources;
+set<string> LinkExports;
+
+// split_list - the items of a comma-separated list
+vector<string> split_list(const string &list)
+{
+    vector<string> items;
+    for (size_t begin = 0, end; begin < list.size(); begin = end + 1)
+    {
+        end = min(list.find(',', begin), list.size());
+        if (end != begin)
+        {
+            items.push_back(list.substr(begin, end - begin));
+        }
+    }
+    return items;
+}
+} // namespace
+
 int main(int argc, char *argv[])
 {
     auto [res, infile, outfile] = args_parse(argc, argv);
     Interpret = res;
 
+    if (StatsOutput != StatsFormat::None)
+    {
+        atexit([] { print_stats(stderr, StatsOutput); });
+    }
+
+    if (!BuildDir.empty())
+    {
+        Interpret = false;
+        freopen("/dev/null", "w", stdout);
+        auto the_target_machine = create_target_machine();
+        return the_target_machine && build_project(BuildDir, the_target_machine) ? 0 : 1;
+    }
+
     if (Interpret)
     {
         InitializeNativeTarget();
         InitializeNativeTargetAsmPrinter();
         InitializeNativeTargetAsmParser();
-        TheJIT = llvm::make_unique<orc::KaleidoscopeJIT>();
+        // --pipeline runs expressions while later items are linked
+        TheJIT = llvm::make_unique<orc::KaleidoscopeJIT>(Indirection, Pipeline);
+        if (!SaveSession.empty())
+        {
+            TheJIT->recordObjects();
+        }
     }
     else
     {
-        freopen(infile.c_str(), "r", stdin);
+        // link_program reads the sources itself
+        if (LinkSources.empty())
+        {
+            freopen(infile.c_str(), "r", stdin);
+        }
         freopen("/dev/null", "w", stdout);
         // freopen("/dev/null", "w", stderr);
     }
 
-    initialize_module_and_pass_manager();
-
-    Parser().main_loop();
+    initialize_module();
 
-    if (Interpret)
+    TargetMachine *the_target_machine = nullptr;
+    if (!Interpret && StreamChunk)
     {
-        return 0;
+        if (!(the_target_machine = create_target_machine()))
+        {
+            return 1;
+        }
+        begin_stream(the_target_machine, outfile);
     }
 
-    InitializeAllTargetInfos();
-    InitializeAllTargets();
-    InitializeAllTargetMCs();
-    InitializeAllAsmParsers();
-    InitializeAllAsmPrinters();
-
-    auto target_triple = sys::getDefaultTargetTriple();
-    TheModule->setTargetTriple(target_triple);
-
-    string error;
-    auto target = TargetRegistry::lookupTarget(target_triple, error);
-
-    if (!target)
+    if (!LoadSession.empty() && !load_session(LoadSession))
+    {
+        return 1;
+    }
+    if (!Prelude.empty() && !load_library(Prelude))
     {
-        errs() << error;
         return 1;
     }
 
-    auto cpu = "generic"s;
-    auto features = "";
-
-    TargetOptions opt;
-    auto rm = Optional<Reloc::Model>();
-    auto the_target_machine = target->createTargetMachine(target_triple, cpu, features, opt, rm);
-
-    TheModule->setDataLayout(the_target_machine->createDataLayout());
+    if (!LinkSources.empty())
+    {
+        if (!link_program(LinkSources, LinkExports))
+        {
+            return 1;
+        }
+    }
+    else if (Jobs > 1)
+    {
+        if (!compile_parallel(infile, Jobs))
+        {
+            return 1;
+        }
+    }
+    else if (Pipeline)
+    {
+        Parser().pipelined_loop();
+    }
+    else
+    {
+        Parser().main_loop();
+    }
 
-    std::error_code ec;
-    raw_fd_ostream dest(outfile, ec, sys::fs::OF_None);
+    if (Interpret)
+    {
+        kaleidoscope_write_profiles();
+        if (!SaveSession.empty() && !save_session(SaveSession))
+        {
+            cerr << "Could not write session image: " << SaveSession << endl;
+            return 1;
+        }
+        return 0;
+    }
 
-    if (ec)
+    // a program with errors lacks the items that failed, so it isn't
+    // written; objects a stream has written already are left as they are
+    if (ErrorCount)
     {
-        errs() << "Could not open file: " << ec.message();
         return 1;
     }
 
-    legacy::PassManager pass;
-    auto file_type = TargetMachine::CGFT_ObjectFile;
+    if (StreamChunk)
+    {
+        return end_stream() ? 0 : 1;
+    }
 
-    if (the_target_machine->addPassesToEmitFile(pass, dest, nullptr, file_type))
+    // libraries may be linked into the JIT, far away from the process, and
+    // shared libraries anywhere
+    the_target_machine = create_target_machine(Library || Shared);
+    if (!the_target_machine)
     {
-        errs() << "The target machine can't emit a file of this type";
         return 1;
     }
 
-    pass.run(*TheModule);
-    dest.flush();
+    if (Library)
+    {
+        TheModule->setTargetTriple(the_target_machine->getTargetTriple().str());
+        TheModule->setDataLayout(the_target_machine->createDataLayout());
+        embed_library_interface(*TheModule);
+    }
+    if (Shared)
+    {
+        auto object = outfile + ".o";
+        auto linked = emit_object(*TheModule, the_target_machine, object)
+                   && link_shared_library(object, outfile);
+        sys::fs::remove(object);
+        return linked ? 0 : 1;
+    }
+    if (!emit_object(*TheModule, the_target_machine, outfile))
+    {
+        return 1;
+    }
 
     // outs() << "Wrote " << outfile << "\n";
 
@@ -112,9 +208,147 @@ tuple<bool, string, string> args_parse(int argc, char *argv[])
         .default_value("a.o"s)
         .action([](const string &value) { return value; });
 
+    program.add_argument("--opt-level")
+        .help("optimization preset: O0, O1, O2, O3, Os or Oz")
+        .default_value("O2"s)
+        .action([](const string &value) { return value; });
+
+    program.add_argument("--passes")
+        .help("custom pass pipeline, e.g. \"function(mem2reg,instcombine,gvn)\"")
+        .default_value(""s)
+        .action([](const string &value) { return value; });
+
+    program.add_argument("--profile-generate")
+        .help("instrument the program and write its profile to this file")
+        .default_value(""s)
+        .action([](const string &value) { return value; });
+
+    program.add_argument("--profile-use")
+        .help("optimize using a profile written by --profile-generate")
+        .default_value(""s)
+        .action([](const string &value) { return value; });
+
+    program.add_argument("--save-session")
+        .help("write the definitions of the REPL session to an image at exit")
+        .default_value(""s)
+        .action([](const string &value) { return value; });
+
+    program.add_argument("--load-session")
+        .help("start the REPL from an image written by --save-session")
+        .default_value(""s)
+        .action([](const string &value) { return value; });
+
+    program.add_argument("--emit")
+        .help("what -c writes: obj, asm, bc (for link-time optimization) or ll")
+        .default_value("obj"s)
+        .action([](const string &value) { return value; });
+
+    program.add_argument("--shared")
+        .help("with -c, link the object into a shared library")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--lto")
+        .help("compile the comma-separated files as one program, optimized as a whole")
+        .default_value(""s)
+        .action([](const string &value) { return value; });
+
+    program.add_argument("--export")
+        .help("with --lto, the comma-separated functions to keep visible; default: those no other function calls")
+        .default_value(""s)
+        .action([](const string &value) { return value; });
+
+    program.add_argument("--library")
+        .help("embed the interfaces of the definitions in the object, for use with --prelude")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--prelude")
+        .help("use the definitions of a library compiled with --library")
+        .default_value(""s)
+        .action([](const string &value) { return value; });
+
+    program.add_argument("--stream")
+        .help("with -c, write an object every n definitions and free their IR, for inputs too large to hold")
+        .default_value(0)
+        .action([](const string &value)
+        {
+            return !value.empty() && value.find_first_not_of("0123456789") == string::npos ? stoi(value) : -1;
+        });
+
+    program.add_argument("--jobs")
+        .help("with -c, parse and compile the input on this many threads")
+        .default_value(1)
+        .action([](const string &value)
+        {
+            return !value.empty() && value.find_first_not_of("0123456789") == string::npos ? stoi(value) : -1;
+        });
+
+    program.add_argument("--max-errors")
+        .help("give up after this many errors, 0 for no limit; default 20 with -c, no limit in the REPL")
+        .default_value(""s)
+        .action([](const string &value) { return value; });
+
+    program.add_argument("--build")
+        .help("compile every .ks file of a directory, skipping files that are up to date")
+        .default_value(""s)
+        .action([](const string &value) { return value; });
+
+    program.add_argument("--pipeline")
+        .help("parse, compile and run the items of a piped script concurrently, without prompts")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--stats")
+        .help("print compile-time and runtime statistics at exit")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--stats-json")
+        .help("print the statistics at exit as JSON")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--memoize")
+        .help("cache results of pure recursive functions")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--specialize")
+        .help("compile calls with constant arguments to copies of the callee with the constants folded in")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--batch")
+        .help("also emit <f>_batch(columns, out, begin, end) evaluating each definition over arrays")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--no-indirection")
+        .help("bind calls directly instead of through stubs; redefined functions only reach new callers")
+        .default_value(false)
+        .implicit_value(true);
+
+    // accept --option=value as well as --option value
+    vector<string> args;
+    for (int i = 0; i < argc; ++i)
+    {
+        string arg = argv[i];
+        auto eq = arg.find('=');
+        if (arg.compare(0, 2, "--") == 0 && eq != string::npos)
+        {
+            args.push_back(arg.substr(0, eq));
+            args.push_back(arg.substr(eq + 1));
+        }
+        else
+        {
+            args.push_back(arg);
+        }
+    }
+
     try
     {
-        program.parse_args(argc, argv);
+        program.parse_args(args);
     }
     catch (const runtime_error &err)
     {
@@ -123,9 +357,108 @@ tuple<bool, string, string> args_parse(int argc, char *argv[])
         exit(0);
     }
 
+    Memoize = program.get<bool>("--memoize");
+    Indirection = !program.get<bool>("--no-indirection");
+    Batch = program.get<bool>("--batch");
+    Specialize = program.get<bool>("--specialize");
+
+    if (program.get<bool>("--stats-json"))
+    {
+        StatsOutput = StatsFormat::Json;
+    }
+    else if (program.get<bool>("--stats"))
+    {
+        StatsOutput = StatsFormat::Text;
+    }
+
+    if (!set_optimization_level(program.get("--opt-level")))
+    {
+        cout << "Unknown optimization level: " << program.get("--opt-level") << endl;
+        exit(1);
+    }
+
+    string pipeline_error;
+    if (!program.get("--passes").empty()
+        && !set_pass_pipeline(program.get("--passes"), pipeline_error))
+    {
+        cout << "Invalid pass pipeline: " << pipeline_error << endl;
+        exit(1);
+    }
+    ProfileGenerate = program.get("--profile-generate");
+
+    auto profile_use = program.get("--profile-use");
+    if (!profile_use.empty() && !load_profile(profile_use))
+    {
+        cout << "Could not read profile: " << profile_use << endl;
+        exit(1);
+    }
+
     auto input_file = program.get("input_file").empty()
                     ? program.get("-c")
                     : program.get("input_file");
 
-    return make_tuple(input_file.empty(), input_file, program.get("-o"));
+    SaveSession = program.get("--save-session");
+    LoadSession = program.get("--load-session");
+    Prelude = program.get("--prelude");
+    Library = program.get<bool>("--library");
+    BuildDir = program.get("--build");
+    Pipeline = program.get<bool>("--pipeline");
+    auto stream = program.get<int>("--stream");
+    if (stream < 0 || (stream && (input_file.empty() || Library)))
+    {
+        cout << "--stream takes a positive number of definitions, with -c and without --library" << endl;
+        exit(1);
+    }
+    StreamChunk = stream;
+
+    auto jobs = program.get<int>("--jobs");
+    if (jobs < 1 || (jobs > 1 && (input_file.empty() || StreamChunk || Library
+        || !ProfileGenerate.empty() || !ProfileCounts.empty())))
+    {
+        cout << "--jobs takes a positive number of threads, with -c and without --stream, --library or profiles" << endl;
+        exit(1);
+    }
+    Jobs = jobs;
+
+    LinkSources = split_list(program.get("--lto"));
+    auto exports = split_list(program.get("--export"));
+    LinkExports.insert(exports.begin(), exports.end());
+    if (!LinkSources.empty() && (!input_file.empty() || StreamChunk))
+    {
+        cout << "--lto takes the place of the input file and can't be combined with --stream" << endl;
+        exit(1);
+    }
+
+    if (!set_emit_kind(program.get("--emit")))
+    {
+        cout << "Unknown output kind: " << program.get("--emit") << endl;
+        exit(1);
+    }
+    Shared = program.get<bool>("--shared");
+    if (Shared && (Emit != EmitKind::Object || StreamChunk))
+    {
+        cout << "--shared links a single object, it can't be combined with --emit or --stream" << endl;
+        exit(1);
+    }
+    if (!input_file.empty() && Pipeline)
+    {
+        cout << "--pipeline is only available in the REPL" << endl;
+        exit(1);
+    }
+    if (!input_file.empty() && !(SaveSession.empty() && LoadSession.empty()))
+    {
+        cout << "Session images are only available in the REPL" << endl;
+        exit(1);
+    }
+
+    auto interpret = input_file.empty() && LinkSources.empty();
+    auto max_errors = program.get("--max-errors");
+    if (max_errors.find_first_not_of("0123456789") != string::npos)
+    {
+        cout << "--max-errors takes a number of errors" << endl;
+        exit(1);
+    }
+    MaxErrors = max_errors.empty() ? (interpret ? 0 : 20) : stoul(max_errors);
+
+    return make_tuple(interpret, input_file, program.get("-o"));
 }
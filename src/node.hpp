@@ -2,13 +2,16 @@
 #define KALEIDOSCOPE_NODE_HPP
 
 #include <map>
+#include <set>
 #include <cstdio>
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <vector>
 #include <cassert>
 #include <utility>
 
+#include "stats.hpp"
 #include "KaleidoscopeJIT.h"
 #include "llvm/ADT/APFloat.h"
 #include "llvm/ADT/STLExtras.h"
@@ -22,10 +25,8 @@
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/IR/LegacyPassManager.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Scalar/GVN.h"
-#include "llvm/Transforms/Utils.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/AlwaysInliner.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Host.h"
 #include "llvm/Support/raw_ostream.h"
@@ -38,19 +39,73 @@ namespace kaleidoscope
 {
 class PrototypeAST;
 
-inline llvm::LLVMContext TheContext;
-inline llvm::IRBuilder<> Builder(TheContext);
-inline std::unique_ptr<llvm::Module> TheModule;
-inline std::unique_ptr<llvm::legacy::FunctionPassManager> TheFPM;
-inline std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT;
-inline std::map<std::string, llvm::AllocaInst*> NamedValues;
-inline std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+// The compiler state is per thread, so that sessions of the embedding API
+// (kaleidoscope.hpp), each running on a thread of its own, share nothing.
+inline thread_local llvm::LLVMContext TheContext;
+inline thread_local llvm::IRBuilder<> Builder(TheContext);
+inline thread_local std::unique_ptr<llvm::Module> TheModule;
+inline thread_local std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT;
+inline thread_local std::map<std::string, llvm::AllocaInst*> NamedValues;
+inline thread_local std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+
+inline thread_local bool Interpret;
+inline thread_local bool Memoize;
+inline thread_local bool Indirection = true;
+// Batch - also emit <f>_batch for every definition, see emit_batch_wrapper
+inline thread_local bool Batch;
+// Specialize - compile calls with constant arguments to copies of the callee
+// with the constants folded in, see specialize; Specializations counts the
+// copies in the current module
+inline thread_local bool Specialize;
+inline thread_local size_t Specializations;
+
+// ErrorCount - number of errors reported so far; they go to stderr unless
+// ErrorLog is set
+inline thread_local size_t ErrorCount;
+inline thread_local std::string *ErrorLog;
+
+// MaxErrors - errors after which Parser::main_loop gives up, 0 for no limit.
+// With a limit, each message goes to stderr at most MaxRepeatedErrors times;
+// ErrorRepeats counts how often each one was reported.
+inline thread_local size_t MaxErrors;
+constexpr size_t MaxRepeatedErrors = 3;
+inline thread_local std::map<std::string, size_t> ErrorRepeats;
+
+// PureFunctions - names of functions known to have no side effects, which
+// are tagged readnone/nounwind so GVN can eliminate repeated calls to them.
+// Seeded with the libm routines commonly declared through extern.
+inline const std::set<std::string> LibmFunctions
+{
+    "sin", "cos", "tan", "atan", "atan2", "sqrt", "exp", "log", "pow", "fabs", "floor", "ceil"
+};
+inline thread_local std::set<std::string> PureFunctions = LibmFunctions;
+// Callers - functions whose definitions call each function, so that the
+// callers of a function redefined with side effects stop being pure as well
+inline thread_local std::map<std::string, std::set<std::string>> Callers;
 
-inline bool Interpret;
+// Fingerprints - fingerprint of the live definition of each function, so
+// that submitting an unchanged definition again can skip compiling it
+inline thread_local std::map<std::string, uint64_t> Fingerprints;
 
 inline std::unique_ptr<class ExprAST> log_error(const char *str)
 {
-    fprintf(stderr, "LogError: %s\n", str);
+    ++ErrorCount;
+    Errors.add();
+    if (ErrorLog)
+    {
+        *ErrorLog += std::string("LogError: ") + str + "\n";
+        return nullptr;
+    }
+
+    auto repeats = MaxErrors ? ++ErrorRepeats[str] : 1;
+    if (repeats < MaxRepeatedErrors)
+    {
+        fprintf(stderr, "LogError: %s\n", str);
+    }
+    else if (repeats == MaxRepeatedErrors)
+    {
+        fprintf(stderr, "LogError: %s (not shown again)\n", str);
+    }
     return nullptr;
 }
 
@@ -72,25 +127,16 @@ inline llvm::Function *log_error_f(const char *str)
     return nullptr;
 }
 
-inline void initialize_module_and_pass_manager()
+inline void initialize_module()
 {
     TheModule = llvm::make_unique<llvm::Module>("My cool jit", TheContext);
+    Specializations = 0;
     if (Interpret)
     {
-        TheModule->setDataLayout(TheJIT->getTargetMachine().createDataLayout());
+        auto &target_machine = TheJIT->getTargetMachine();
+        TheModule->setDataLayout(target_machine.createDataLayout());
+        TheModule->setTargetTriple(target_machine.getTargetTriple().str());
     }
-
-    TheFPM = llvm::make_unique<llvm::legacy::FunctionPassManager>(TheModule.get());
-
-    TheFPM->add(llvm::createInstructionCombiningPass());
-    TheFPM->add(llvm::createReassociatePass());
-    TheFPM->add(llvm::createGVNPass());
-    TheFPM->add(llvm::createCFGSimplificationPass());
-    TheFPM->add(llvm::createPromoteMemoryToRegisterPass());
-    TheFPM->add(llvm::createInstructionCombiningPass());
-    TheFPM->add(llvm::createReassociatePass());
-
-    TheFPM->doInitialization();
 }
 
 inline llvm::AllocaInst *create_entry_block_alloca(llvm::Function *the_function,
@@ -105,8 +151,15 @@ inline llvm::AllocaInst *create_entry_block_alloca(llvm::Function *the_function,
 class ExprAST
 {
   public:
+    ExprAST() { ASTNodes.add(); }
     virtual ~ExprAST() {}
     virtual llvm::Value *codegen() = 0;
+    // collect names of all functions (including operators) this expression may call
+    virtual void collect_callees(std::set<std::string> &callees) const = 0;
+    // collect names of all variables this expression may assign or declare
+    virtual void collect_assigned(std::set<std::string> &names) const = 0;
+    // append a canonical form of the expression, equal for equal trees
+    virtual void write_key(std::string &key) const = 0;
 };
 
 // NumberExprAST - Expression class for numeric literals like "1.0"
@@ -116,7 +169,11 @@ class NumberExprAST : public ExprAST
 
   public:
     NumberExprAST(double value) : value_(value) {}
+    double get_value() const { return value_; }
     llvm::Value *codegen() override;
+    void collect_callees(std::set<std::string> &callees) const override {}
+    void collect_assigned(std::set<std::string> &names) const override {}
+    void write_key(std::string &key) const override;
 };
 
 // VariableExprAST - Expression class for referencing a variable, like "a".
@@ -126,8 +183,11 @@ class VariableExprAST : public ExprAST
 
   public:
     VariableExprAST(const std::string &name) : name_(name) {}
-    const std::string &get_name() { return name_; }
+    const std::string &get_name() const { return name_; }
     llvm::Value *codegen() override;
+    void collect_callees(std::set<std::string> &callees) const override {}
+    void collect_assigned(std::set<std::string> &names) const override {}
+    void write_key(std::string &key) const override;
 };
 
 class UnaryExprAST : public ExprAST
@@ -140,6 +200,9 @@ class UnaryExprAST : public ExprAST
       : op_(op), operand_(std::move(operand)) {}
 
     llvm::Value *codegen() override;
+    void collect_callees(std::set<std::string> &callees) const override;
+    void collect_assigned(std::set<std::string> &names) const override;
+    void write_key(std::string &key) const override;
 };
 
 // BinaryExprAST - Expression class for a binary operator.
@@ -153,7 +216,13 @@ class BinaryExprAST : public ExprAST
         std::unique_ptr<ExprAST> lhs,
         std::unique_ptr<ExprAST> rhs)
       : op_(op), lhs_(std::move(lhs)), rhs_(std::move(rhs)) {}
+    char get_op() const { return op_; }
+    ExprAST &get_lhs() { return *lhs_; }
+    ExprAST &get_rhs() { return *rhs_; }
     llvm::Value *codegen() override;
+    void collect_callees(std::set<std::string> &callees) const override;
+    void collect_assigned(std::set<std::string> &names) const override;
+    void write_key(std::string &key) const override;
 };
 
 // CallExprAST - Expression class for function calls.
@@ -167,6 +236,9 @@ class CallExprAST : public ExprAST
         std::vector<std::unique_ptr<ExprAST>> args)
       : callee_(callee), args_(std::move(args)) {}
     llvm::Value *codegen() override;
+    void collect_callees(std::set<std::string> &callees) const override;
+    void collect_assigned(std::set<std::string> &names) const override;
+    void write_key(std::string &key) const override;
 };
 
 class IfExprAST : public ExprAST
@@ -180,6 +252,9 @@ class IfExprAST : public ExprAST
       : cond_(std::move(cond)), then_(std::move(then)), else_(std::move(els)) {}
 
     llvm::Value *codegen() override;
+    void collect_callees(std::set<std::string> &callees) const override;
+    void collect_assigned(std::set<std::string> &names) const override;
+    void write_key(std::string &key) const override;
 };
 
 class ForExprAST : public ExprAST
@@ -197,6 +272,38 @@ class ForExprAST : public ExprAST
         step_(move(step)), body_(move(body)) {}
 
     llvm::Value *codegen() override;
+    void collect_callees(std::set<std::string> &callees) const override;
+    void collect_assigned(std::set<std::string> &names) const override;
+    void write_key(std::string &key) const override;
+
+  private:
+    ExprAST *counted_bound(llvm::Value *start, double step);
+    bool emit_counted_loop(llvm::AllocaInst *variable, llvm::Value *start, double step, ExprAST &bound);
+    bool emit_loop(llvm::AllocaInst *variable);
+};
+
+// ParForExprAST - a for loop over a counted range whose iterations run in
+// parallel, optionally combining the values of the body with + or *
+class ParForExprAST : public ExprAST
+{
+    std::string var_name_;
+    std::unique_ptr<ExprAST> start_, end_, step_, body_;
+    char reduce_op_;
+
+  public:
+    ParForExprAST(const std::string &var_name,
+        std::unique_ptr<ExprAST> start,
+        std::unique_ptr<ExprAST> end,
+        std::unique_ptr<ExprAST> step,
+        char reduce_op,
+        std::unique_ptr<ExprAST> body)
+      : var_name_(var_name), start_(move(start)), end_(move(end)),
+        step_(move(step)), body_(move(body)), reduce_op_(reduce_op) {}
+
+    llvm::Value *codegen() override;
+    void collect_callees(std::set<std::string> &callees) const override;
+    void collect_assigned(std::set<std::string> &names) const override;
+    void write_key(std::string &key) const override;
 };
 
 class VarExprAST : public ExprAST
@@ -210,6 +317,9 @@ class VarExprAST : public ExprAST
       : var_names_(std::move(var_names)), body_(std::move(body)) {}
 
     llvm::Value *codegen() override;
+    void collect_callees(std::set<std::string> &callees) const override;
+    void collect_assigned(std::set<std::string> &names) const override;
+    void write_key(std::string &key) const override;
 };
 
 // PrototypeAST - This class represents the "prototype" for a function,
@@ -230,6 +340,8 @@ class PrototypeAST
         is_operator_(is_operator), precedence_(precedence) {}
 
     const std::string &get_name() const { return name_; }
+    const std::vector<std::string> &get_args() const { return args_; }
+    bool is_operator() const { return is_operator_; }
     bool is_unary_op() const { return is_operator_ && args_.size() == 1; }
     bool is_binary_op() const { return is_operator_ && args_.size() == 2; }
     char get_operator_name() const
@@ -251,8 +363,22 @@ class FunctionAST
     FunctionAST(std::unique_ptr<PrototypeAST> proto,
         std::unique_ptr<ExprAST> body)
       : proto_(std::move(proto)), body_(std::move(body)) {}
+    const std::string &get_name() const { return proto_->get_name(); }
+    const PrototypeAST &get_proto() const { return *proto_; }
     llvm::Function *codegen();
+    // fingerprint - hash of the definition and of the signatures it calls,
+    // equal for definitions that compile to the same code
+    uint64_t fingerprint() const;
 };
+
+// FunctionBodies - body of the live definition of each function, kept with
+// Specialize to compile specialized copies of it
+inline thread_local std::map<std::string, std::unique_ptr<ExprAST>> FunctionBodies;
+
+// ImportedProtos - prototypes of the functions of the whole program when it
+// is compiled in parts, see compile_parallel; get_function copies one into
+// FunctionProtos the first time its name is used
+inline thread_local const std::map<std::string, std::unique_ptr<PrototypeAST>> *ImportedProtos;
 } // namespace kaleidoscope
 
 #endif // KALEIDOSCOPE_NODE_HPP
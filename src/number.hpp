@@ -0,0 +1,37 @@
+#ifndef KALEIDOSCOPE_NUMBER_HPP
+#define KALEIDOSCOPE_NUMBER_HPP
+
+#include <string>
+#include <charconv>
+#include <system_error>
+
+namespace kaleidoscope
+{
+// MaxNumberLength - longest text format_number writes
+constexpr size_t MaxNumberLength = 32;
+
+// parse_number - the double nearest to a number literal; false if the text
+// isn't one or its value is out of range. Unlike stod it doesn't depend on
+// the locale.
+inline bool parse_number(const std::string &text, double &value)
+{
+    auto end = text.data() + text.size();
+    auto result = std::from_chars(text.data(), end, value);
+    return result.ec == std::errc() && result.ptr == end;
+}
+
+// format_number - write the shortest text that parses back to x, returning
+// the end of it
+inline char *format_number(char *out, double x)
+{
+    return std::to_chars(out, out + MaxNumberLength, x).ptr;
+}
+
+inline std::string format_number(double x)
+{
+    char text[MaxNumberLength];
+    return std::string(text, format_number(text, x));
+}
+} // namespace kaleidoscope
+
+#endif // KALEIDOSCOPE_NUMBER_HPP
@@ -0,0 +1,115 @@
+#include <string>
+
+#include "stats.hpp"
+#include "profile.hpp"
+#include "optimizer.hpp"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Transforms/IPO/AlwaysInliner.h"
+#include "llvm/Transforms/IPO/HotColdSplitting.h"
+
+using namespace std;
+using namespace llvm;
+
+namespace
+{
+PassBuilder::OptimizationLevel OptLevel = PassBuilder::O2;
+string PassPipeline;
+} // namespace
+
+namespace kaleidoscope
+{
+bool set_optimization_level(const string &level)
+{
+    if (level == "O0")
+    {
+        OptLevel = PassBuilder::O0;
+    }
+    else if (level == "O1")
+    {
+        OptLevel = PassBuilder::O1;
+    }
+    else if (level == "O2")
+    {
+        OptLevel = PassBuilder::O2;
+    }
+    else if (level == "O3")
+    {
+        OptLevel = PassBuilder::O3;
+    }
+    else if (level == "Os")
+    {
+        OptLevel = PassBuilder::Os;
+    }
+    else if (level == "Oz")
+    {
+        OptLevel = PassBuilder::Oz;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+bool set_pass_pipeline(const string &pipeline, string &error)
+{
+    ModulePassManager mpm;
+    if (auto err = PassBuilder().parsePassPipeline(mpm, pipeline))
+    {
+        error = toString(move(err));
+        return false;
+    }
+    PassPipeline = pipeline;
+    return true;
+}
+
+void optimize_module(Module &module, TargetMachine *target_machine, bool pre_link)
+{
+    ScopedTimer timer(OptimizeTime);
+    if (PassPipeline.empty() && OptLevel == PassBuilder::O0 && ProfileCounts.empty())
+    {
+        OptimizedIRInstructions.add(module.getInstructionCount());
+        return;
+    }
+
+    // the analysis managers cache results per IR unit, and modules are moved
+    // into the JIT once optimized, so they are rebuilt for every run
+    PassBuilder pb(target_machine);
+    LoopAnalysisManager lam;
+    FunctionAnalysisManager fam;
+    CGSCCAnalysisManager cgam;
+    ModuleAnalysisManager mam;
+
+    pb.registerModuleAnalyses(mam);
+    pb.registerCGSCCAnalyses(cgam);
+    pb.registerFunctionAnalyses(fam);
+    pb.registerLoopAnalyses(lam);
+    pb.crossRegisterProxies(lam, fam, cgam, mam);
+
+    ModulePassManager mpm;
+    if (!PassPipeline.empty())
+    {
+        cantFail(pb.parsePassPipeline(mpm, PassPipeline));
+    }
+    else if (OptLevel != PassBuilder::O0)
+    {
+        mpm = pre_link ? pb.buildLTOPreLinkDefaultPipeline(OptLevel)
+                       : pb.buildPerModuleDefaultPipeline(OptLevel);
+    }
+
+    // the profile marked hot call sites always_inline and never-run
+    // functions cold, let the module passes act on that
+    if (!ProfileCounts.empty())
+    {
+        mpm.addPass(AlwaysInlinerPass());
+        mpm.addPass(HotColdSplittingPass());
+    }
+    mpm.run(module, mam);
+
+    if (StatsOutput != StatsFormat::None)
+    {
+        OptimizedIRInstructions.add(module.getInstructionCount());
+    }
+}
+} // namespace kaleidoscope
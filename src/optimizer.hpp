@@ -0,0 +1,29 @@
+#ifndef KALEIDOSCOPE_OPTIMIZER_HPP
+#define KALEIDOSCOPE_OPTIMIZER_HPP
+
+#include <string>
+
+#include "llvm/IR/Module.h"
+#include "llvm/Target/TargetMachine.h"
+
+namespace kaleidoscope
+{
+// set_optimization_level - select one of the O0/O1/O2/O3/Os/Oz presets,
+// returns false if the name is unknown
+bool set_optimization_level(const std::string &level);
+
+// set_pass_pipeline - use a textual pass pipeline such as
+// "function(mem2reg,instcombine,gvn)" instead of the preset, returns false
+// and fills error if it can't be parsed
+bool set_pass_pipeline(const std::string &pipeline, std::string &error);
+
+// optimize_module - run the selected pipeline over a whole module, used on
+// every module handed to the JIT and on the module emitted by -c. With
+// pre_link the preset stops short of the optimizations that link-time
+// optimization will run once the module is linked with others. With a
+// profile loaded, hot call sites are inlined and cold code is split out even
+// at O0.
+void optimize_module(llvm::Module &module, llvm::TargetMachine *target_machine, bool pre_link = false);
+} // namespace kaleidoscope
+
+#endif // KALEIDOSCOPE_OPTIMIZER_HPP
@@ -0,0 +1,232 @@
+#include <map>
+#include <atomic>
+#include <cctype>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <functional>
+
+#include "node.hpp"
+#include "parser.hpp"
+#include "parallel.hpp"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+using namespace std;
+using namespace llvm;
+
+namespace
+{
+using namespace kaleidoscope;
+
+// PartsPerJob - parts the source is cut into for each thread, so that
+// threads which finish early can take over the rest
+constexpr size_t PartsPerJob = 16;
+constexpr size_t MinPartSize = 64 << 10;
+
+// item_offsets - offsets of the def and extern keywords that start items,
+// found with the token rules of Lexer::lex but without building tokens
+vector<size_t> item_offsets(const string &source)
+{
+    vector<size_t> offsets;
+    size_t i = 0, n = source.size();
+    while (i < n)
+    {
+        auto c = static_cast<unsigned char>(source[i]);
+        if (isalpha(c))
+        {
+            auto begin = i;
+            while (i < n && isalnum(static_cast<unsigned char>(source[i])))
+            {
+                ++i;
+            }
+            if (source.compare(begin, i - begin, "def") == 0 || source.compare(begin, i - begin, "extern") == 0)
+            {
+                offsets.push_back(begin);
+            }
+        }
+        else if (isdigit(c) || c == '.')
+        {
+            while (i < n && (isdigit(static_cast<unsigned char>(source[i])) || source[i] == '.'))
+            {
+                ++i;
+            }
+        }
+        else if (c == '#')
+        {
+            while (i < n && source[i] != '\n' && source[i] != '\r')
+            {
+                ++i;
+            }
+        }
+        else
+        {
+            ++i;
+        }
+    }
+    return offsets;
+}
+
+// split_parts - the source cut at item boundaries into parts of about size
+// bytes or more
+vector<string> split_parts(const string &source, size_t size)
+{
+    vector<string> parts;
+    size_t begin = 0;
+    for (auto offset : item_offsets(source))
+    {
+        if (offset - begin >= size)
+        {
+            parts.push_back(source.substr(begin, offset - begin));
+            begin = offset;
+        }
+    }
+    parts.push_back(source.substr(begin));
+    return parts;
+}
+
+// run_jobs - call work(i) for every part i on jobs threads, each with
+// compiler state of its own. The errors the threads report are added to
+// ErrorCount; once they reach MaxErrors, no further parts are started.
+void run_jobs(size_t jobs, size_t parts, const function<void(size_t)> &work)
+{
+    // options are per thread too, the threads start with those of this one
+    auto memoize = Memoize;
+    auto batch = Batch;
+    auto specialize = Specialize;
+    auto max_errors = MaxErrors;
+
+    atomic<size_t> next { 0 }, errors { 0 };
+    vector<thread> threads;
+    for (size_t t = 0; t < jobs; ++t)
+    {
+        threads.emplace_back([&]
+        {
+            Interpret = false;
+            Memoize = memoize;
+            Batch = batch;
+            Specialize = specialize;
+            MaxErrors = max_errors;
+            for (size_t i; (!max_errors || errors < max_errors) && (i = next++) < parts;)
+            {
+                auto before = ErrorCount;
+                work(i);
+                errors += ErrorCount - before;
+            }
+        });
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    ErrorCount += errors;
+}
+} // namespace
+
+namespace kaleidoscope
+{
+bool compile_parallel(const string &file, size_t jobs)
+{
+    ifstream in(file);
+    if (!in)
+    {
+        fprintf(stderr, "Could not read %s\n", file.c_str());
+        return false;
+    }
+    ostringstream contents;
+    contents << in.rdbuf();
+    auto source = contents.str();
+    auto parts = split_parts(source, max(source.size() / (jobs * PartsPerJob), MinPartSize));
+    source.clear();
+    source.shrink_to_fit();
+
+    // every part may call functions and use operators defined in any other
+    vector<vector<unique_ptr<PrototypeAST>>> part_protos(parts.size());
+    run_jobs(jobs, parts.size(), [&](size_t i)
+    {
+        part_protos[i] = Parser(parts[i]).scan_prototypes();
+    });
+
+    map<string, unique_ptr<PrototypeAST>> protos;
+    for (auto &part : part_protos)
+    {
+        for (auto &proto : part)
+        {
+            auto name = proto->get_name();
+            protos[name] = move(proto);
+        }
+    }
+    part_protos.clear();
+
+    // parts with errors are incomplete, there is no program to link
+    auto errors = ErrorCount;
+    vector<string> bitcode(parts.size());
+    run_jobs(jobs, parts.size(), [&](size_t i)
+    {
+        if (!ImportedProtos)
+        {
+            ImportedProtos = &protos;
+            for (auto &name_proto : protos)
+            {
+                if (name_proto.second->is_binary_op())
+                {
+                    Parser::set_binary_precedence(name_proto.second->get_operator_name(),
+                        name_proto.second->get_binary_precedence());
+                }
+            }
+        }
+
+        initialize_module();
+        Parser(move(parts[i])).main_loop();
+        raw_string_ostream out(bitcode[i]);
+        WriteBitcodeToFile(*TheModule, out);
+        out.flush();
+        TheModule.reset();
+    });
+    if (ErrorCount != errors)
+    {
+        return false;
+    }
+
+    // link the parts in order; as in a single module, a later definition of
+    // a function, or top-level expression, replaces the one before it
+    Linker linker(*TheModule);
+    for (size_t i = 0; i < bitcode.size(); ++i)
+    {
+        auto module = parseBitcodeFile(MemoryBufferRef(bitcode[i], file), TheContext);
+        if (!module)
+        {
+            consumeError(module.takeError());
+            fprintf(stderr, "Could not read back part %zu of %s\n", i, file.c_str());
+            return false;
+        }
+        bitcode[i].clear();
+        bitcode[i].shrink_to_fit();
+
+        for (auto &f : (*module)->functions())
+        {
+            if (f.isDeclaration() || f.hasLocalLinkage())
+            {
+                continue;
+            }
+            auto earlier = TheModule->getFunction(f.getName());
+            if (earlier && !earlier->isDeclaration())
+            {
+                earlier->deleteBody();
+            }
+        }
+        if (linker.linkInModule(move(*module)))
+        {
+            fprintf(stderr, "Could not link part %zu of %s\n", i, file.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+} // namespace kaleidoscope
@@ -0,0 +1,17 @@
+#ifndef KALEIDOSCOPE_PARALLEL_HPP
+#define KALEIDOSCOPE_PARALLEL_HPP
+
+#include <string>
+
+namespace kaleidoscope
+{
+// compile_parallel - compile a source file into TheModule on several
+// threads. The source is cut into parts at def and extern keywords; every
+// part is scanned for its prototypes, then parsed and compiled into a
+// module of its own on the thread's context, against the prototypes and
+// operators of the whole file. The modules are linked in source order, a
+// later definition of a function replacing an earlier one.
+bool compile_parallel(const std::string &file, size_t jobs);
+} // namespace kaleidoscope
+
+#endif // KALEIDOSCOPE_PARALLEL_HPP
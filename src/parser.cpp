@@ -1,22 +1,28 @@
 #include <cstdio>
 #include <string>
+#include <unistd.h>
 #include <vector>
 #include <cassert>
 #include <utility>
+#include <algorithm>
 
 #include "node.hpp"
 #include "parser.hpp"
+#include "emit.hpp"
+#include "number.hpp"
+#include "builtin.hpp"
+#include "optimizer.hpp"
 
 using namespace std;
 
-namespace kaleidoscope
+namespace
 {
-list<size_t> Parser::precedences_
+const list<size_t> DefaultPrecedences
 {
     2, 10, 20, 40
 };
 
-unordered_map<size_t, set<char>> Parser::precedence_symbols_
+const unordered_map<size_t, set<char>> DefaultPrecedenceSymbols
 {
     {  2, { '=' } },
     { 10, { '<' } },
@@ -24,7 +30,7 @@ unordered_map<size_t, set<char>> Parser::precedence_symbols_
     { 40, { '*' } },
 };
 
-unordered_map<char, size_t> Parser::symbol_precedences_
+const unordered_map<char, size_t> DefaultSymbolPrecedences
 {
     { '=',  2 },
     { '<', 10 },
@@ -32,10 +38,27 @@ unordered_map<char, size_t> Parser::symbol_precedences_
     { '-', 20 },
     { '*', 40 },
 };
+} // namespace
+
+namespace kaleidoscope
+{
+thread_local list<size_t> Parser::precedences_ = DefaultPrecedences;
+thread_local unordered_map<size_t, set<char>> Parser::precedence_symbols_ = DefaultPrecedenceSymbols;
+thread_local unordered_map<char, size_t> Parser::symbol_precedences_ = DefaultSymbolPrecedences;
 
 void Parser::main_loop()
 {
-    fprintf(stdout, R"( _         _      _     _
+    auto prompt = [this]
+    {
+        if (interactive_)
+        {
+            fprintf(stdout, "ready> ");
+        }
+    };
+
+    if (interactive_)
+    {
+        fprintf(stdout, R"( _         _      _     _
 | | ____ _| | ___(_) __| | ___  ___  ___ ___  _ __   ___
 | |/ / _` | |/ _ \ |/ _` |/ _ \/ __|/ __/ _ \| '_ \ / _ \
 |   < (_| | |  __/ | (_| | (_) \__ \ (_| (_) | |_) |  __/
@@ -45,10 +68,18 @@ void Parser::main_loop()
 See more on https://llvm.org/docs/tutorial/MyFirstLanguageFrontend
 
 )");
-    fprintf(stdout, "ready> ");
+    }
+    prompt();
     get_next_token();
+    auto errors = ErrorCount;
     while (true)
     {
+        if (MaxErrors && ErrorCount - errors >= MaxErrors)
+        {
+            fprintf(stderr, "LogError: too many errors, giving up\n");
+            return;
+        }
+
         switch (cur_token_.type())
         {
         case Token::END:
@@ -58,15 +89,15 @@ See more on https://llvm.org/docs/tutorial/MyFirstLanguageFrontend
             break;
         case Token::DEF:
             handle_definition();
-            fprintf(stdout, "ready> ");
+            prompt();
             break;
         case Token::EXTERN:
             handle_extern();
-            fprintf(stdout, "ready> ");
+            prompt();
             break;
         default:
             handle_top_level_expression();
-            fprintf(stdout, "ready> ");
+            prompt();
             break;
         }
     }
@@ -77,6 +108,28 @@ Token Parser::get_next_token()
     return cur_token_ = lexer_.next();
 }
 
+void Parser::reset_precedences()
+{
+    precedences_ = DefaultPrecedences;
+    precedence_symbols_ = DefaultPrecedenceSymbols;
+    symbol_precedences_ = DefaultSymbolPrecedences;
+}
+
+void Parser::set_binary_precedence(char op, size_t precedence)
+{
+    if (symbol_precedences_.count(op) && symbol_precedences_[op] != precedence)
+    {
+        precedence_symbols_[symbol_precedences_[op]].erase(op);
+    }
+    symbol_precedences_[op] = precedence;
+    auto pos = lower_bound(precedences_.begin(), precedences_.end(), precedence);
+    if (pos == precedences_.end() || *pos != precedence)
+    {
+        precedences_.insert(pos, precedence);
+    }
+    precedence_symbols_[precedence].insert(op);
+}
+
 unique_ptr<ExprAST> Parser::parse_expression(list<size_t>::iterator precedence)
 {
     if (precedence == precedences_.end())
@@ -112,8 +165,12 @@ unique_ptr<ExprAST> Parser::parse_primary()
         return parse_if_expr();
     case Token::FOR:
         return parse_for_expr();
+    case Token::PARFOR:
+        return parse_parfor_expr();
     case Token::VAR:
         return parse_var_expr();
+    case Token::INVALID:
+        return log_error(("malformed number " + cur_token_.value()).c_str());
     default:
         if (!isascii(cur_token_.type()))
         {
@@ -136,9 +193,13 @@ unique_ptr<ExprAST> Parser::parse_unary()
 
 unique_ptr<ExprAST> Parser::parse_number_expr()
 {
-    auto result = std::make_unique<NumberExprAST>(stod(cur_token_.value()));
+    double value;
+    if (!parse_number(cur_token_.value(), value))
+    {
+        return log_error(("number out of range " + cur_token_.value()).c_str());
+    }
     get_next_token();
-    return result;
+    return std::make_unique<NumberExprAST>(value);
 }
 
 unique_ptr<ExprAST> Parser::parse_paren_expr()
@@ -291,6 +352,80 @@ unique_ptr<ExprAST> Parser::parse_for_expr()
     return std::make_unique<ForExprAST>(var_name, move(start), move(end), move(step), move(body));
 }
 
+// parfor i = start, end [, step] [reduce op] in body
+unique_ptr<ExprAST> Parser::parse_parfor_expr()
+{
+    get_next_token();
+
+    if (cur_token_.type() != Token::IDENTIFIER)
+    {
+        return log_error("expected identifier after parfor");
+    }
+
+    auto var_name = cur_token_.value();
+    get_next_token();
+
+    if (cur_token_.type() != '=')
+    {
+        return log_error("expected '=' after parfor");
+    }
+    get_next_token();
+
+    auto start = parse_expression();
+    if (!start)
+    {
+        return nullptr;
+    }
+    if (cur_token_.type() != ',')
+    {
+        return log_error("expected ',' after parfor start value");
+    }
+    get_next_token();
+
+    auto end = parse_expression();
+    if (!end)
+    {
+        return nullptr;
+    }
+
+    unique_ptr<ExprAST> step;
+    if (cur_token_.type() == ',')
+    {
+        get_next_token();
+        step = parse_expression();
+        if (!step)
+        {
+            return nullptr;
+        }
+    }
+
+    char reduce_op = 0;
+    if (cur_token_.type() == Token::REDUCE)
+    {
+        get_next_token();
+        if (cur_token_.type() != '+' && cur_token_.type() != '*')
+        {
+            return log_error("expected '+' or '*' after reduce");
+        }
+        reduce_op = cur_token_.type();
+        get_next_token();
+    }
+
+    if (cur_token_.type() != Token::IN)
+    {
+        return log_error("expected 'in' after parfor");
+    }
+    get_next_token();
+
+    auto body = parse_expression();
+    if (!body)
+    {
+        return nullptr;
+    }
+
+    return std::make_unique<ParForExprAST>(var_name, move(start), move(end), move(step), reduce_op, move(body));
+}
+
 unique_ptr<ExprAST> Parser::parse_var_expr()
 {
     get_next_token();
@@ -349,6 +484,7 @@ unique_ptr<ExprAST> Parser::parse_var_expr()
 
 unique_ptr<PrototypeAST> Parser::parse_extern()
 {
+    ScopedTimer timer(ParseTime);
     get_next_token();
     return parse_prototype();
 }
@@ -389,12 +525,12 @@ unique_ptr<PrototypeAST> Parser::parse_prototype()
 
         if (cur_token_.type() == Token::NUMBER)
         {
-            auto num_val = stoi(cur_token_.value());
-            if (num_val < 1 || num_val > 100)
+            double num_val;
+            if (!parse_number(cur_token_.value(), num_val) || num_val < 1 || num_val >= 101)
             {
                 return log_error_p("Invalid precedence: must be 1..100");
             }
-            binary_precedence = num_val;
+            binary_precedence = (int)num_val;
         }
         break;
     }
@@ -423,8 +559,37 @@ unique_ptr<PrototypeAST> Parser::parse_prototype()
     return std::make_unique<PrototypeAST>(fn_name, move(args), kind, binary_precedence);
 }
 
+vector<unique_ptr<PrototypeAST>> Parser::scan_prototypes(bool definitions_only)
+{
+    auto errors = ErrorCount;
+    auto error_log = ErrorLog;
+    string ignored;
+    ErrorLog = &ignored;
+
+    vector<unique_ptr<PrototypeAST>> protos;
+    get_next_token();
+    while (cur_token_.type() != Token::END)
+    {
+        if (cur_token_.type() == Token::DEF || (cur_token_.type() == Token::EXTERN && !definitions_only))
+        {
+            get_next_token();
+            if (auto proto = parse_prototype())
+            {
+                protos.push_back(move(proto));
+            }
+            continue;
+        }
+        get_next_token();
+    }
+
+    ErrorLog = error_log;
+    ErrorCount = errors;
+    return protos;
+}
+
 unique_ptr<FunctionAST> Parser::parse_definition()
 {
+    ScopedTimer timer(ParseTime);
     get_next_token();
     auto proto = parse_prototype();
     if (!proto)
@@ -440,6 +605,7 @@ unique_ptr<FunctionAST> Parser::parse_definition()
 
 unique_ptr<FunctionAST> Parser::parse_top_level_expr()
 {
+    ScopedTimer timer(ParseTime);
     if (auto expr = parse_expression())
     {
         auto proto = std::make_unique<PrototypeAST>("__anno_expr", vector<string>(), false);
@@ -448,28 +614,32 @@ unique_ptr<FunctionAST> Parser::parse_top_level_expr()
     return nullptr;
 }
 
-void Parser::handle_definition()
+void Parser::synchronize()
 {
-    if (auto fn_ast = parse_definition())
+    // at a terminal the rest of the line goes instead, so that the next line
+    // typed is a new item and gets its prompt
+    auto at_prompt = interactive_ && isatty(fileno(stdin));
+    while (cur_token_.type() != Token::DEF && cur_token_.type() != Token::EXTERN
+        && cur_token_.type() != ';' && cur_token_.type() != Token::END)
     {
-        if (auto fn_ir = fn_ast->codegen())
+        if (at_prompt && lexer_.at_end_of_line())
         {
-            /*
-            fprintf(stdout, "Parsed a function definition\n");
-            fn_ir->print(llvm::errs());
-            fprintf(stdout, "\n");
-            */
-
-            if (Interpret)
-            {
-                TheJIT->addModule(move(TheModule));
-                initialize_module_and_pass_manager();
-            }
+            cur_token_ = Token(';');
+            break;
         }
+        get_next_token();
+    }
+}
+
+void Parser::handle_definition()
+{
+    if (auto fn_ast = parse_definition())
+    {
+        compile_definition(move(fn_ast));
     }
     else
     {
-        get_next_token();
+        synchronize();
     }
 }
 
@@ -477,20 +647,11 @@ void Parser::handle_extern()
 {
     if (auto proto_ast = parse_extern())
     {
-        if (auto proto_ir = proto_ast->codegen())
-        {
-            /*
-            fprintf(stdout, "Parsed an extern\n");
-            proto_ir->print(llvm::errs());
-            fprintf(stdout, "\n");
-            */
-
-            FunctionProtos[proto_ast->get_name()] = move(proto_ast);
-        }
+        compile_extern(move(proto_ast));
     }
     else
     {
-        get_next_token();
+        synchronize();
     }
 }
 
@@ -498,33 +659,118 @@ void Parser::handle_top_level_expression()
 {
     if (auto fn_ast = parse_top_level_expr())
     {
-        if (auto fn_ir = fn_ast->codegen())
+        auto compiled = compile_top_level_expression(move(fn_ast));
+        if (compiled.second)
         {
-            /*
-            fprintf(stdout, "Read top-level expression\n");
-            fn_ir->print(llvm::errs());
-            fprintf(stdout, "\n");
-            */
+            run_top_level_expression(compiled.second);
+            TheJIT->removeModule(compiled.first);
+        }
+    }
+    else
+    {
+        synchronize();
+    }
+}
 
-            if (Interpret)
-            {
-                auto h = TheJIT->addModule(move(TheModule));
-                initialize_module_and_pass_manager();
+void Parser::compile_definition(unique_ptr<FunctionAST> fn_ast)
+{
+    Definitions.add();
 
-                auto expr_symbol = TheJIT->findSymbol("__anno_expr");
-                assert(expr_symbol && "Function not found");
+    // the JIT still holds the code of an unchanged definition
+    uint64_t fingerprint = 0;
+    if (Interpret)
+    {
+        fingerprint = fn_ast->fingerprint();
+        auto it = Fingerprints.find(fn_ast->get_name());
+        if (it != Fingerprints.end() && it->second == fingerprint)
+        {
+            ReusedDefinitions.add();
+            return;
+        }
+        Fingerprints.erase(fn_ast->get_name());
+    }
 
-                auto fp = (double (*)())expr_symbol.getAddress().get();
-                // fprintf(stdout, "Evaluated to %f\n", fp());
-                fprintf(stdout, "%f\n", fp());
+    auto name = fn_ast->get_name();
+    if (auto fn_ir = fn_ast->codegen())
+    {
+        /*
+        fprintf(stdout, "Parsed a function definition\n");
+        fn_ir->print(llvm::errs());
+        fprintf(stdout, "\n");
+        */
 
-                TheJIT->removeModule(h);
-            }
+        if (Interpret)
+        {
+            optimize_module(*TheModule, &TheJIT->getTargetMachine());
+            TheJIT->addModule(move(TheModule));
+            initialize_module();
+            Fingerprints[name] = fingerprint;
+        }
+        else if (StreamChunk)
+        {
+            stream_definition(name);
         }
     }
-    else
+}
+
+void Parser::compile_extern(unique_ptr<PrototypeAST> proto_ast)
+{
+    Externs.add();
+    if (auto proto_ir = proto_ast->codegen())
     {
-        get_next_token();
+        /*
+        fprintf(stdout, "Parsed an extern\n");
+        proto_ir->print(llvm::errs());
+        fprintf(stdout, "\n");
+        */
+
+        FunctionBodies.erase(proto_ast->get_name());
+        FunctionProtos[proto_ast->get_name()] = move(proto_ast);
+    }
+}
+
+pair<llvm::orc::VModuleKey, double (*)()> Parser::compile_top_level_expression(unique_ptr<FunctionAST> fn_ast)
+{
+    TopLevelExprs.add();
+    if (auto fn_ir = fn_ast->codegen())
+    {
+        /*
+        fprintf(stdout, "Read top-level expression\n");
+        fn_ir->print(llvm::errs());
+        fprintf(stdout, "\n");
+        */
+
+        if (Interpret)
+        {
+            optimize_module(*TheModule, &TheJIT->getTargetMachine());
+            auto h = TheJIT->addModule(move(TheModule));
+            initialize_module();
+
+            ScopedTimer timer(JITMaterializeTime);
+            // the expression may run after newer ones are added, as with
+            // --pipeline, so look it up in its own module
+            auto expr_symbol = TheJIT->findSymbolIn(h, "__anno_expr");
+            assert(expr_symbol && "Function not found");
+
+            return { h, (double (*)())expr_symbol.getAddress().get() };
+        }
+    }
+    return { 0, nullptr };
+}
+
+void Parser::run_top_level_expression(double (*fp)())
+{
+    double result;
+    {
+        ScopedTimer timer(ExecuteTime);
+        result = fp();
+    }
+    flushd();
+    // fprintf(stdout, "Evaluated to %f\n", result);
+    if (interactive_)
+    {
+        fprintf(stdout, "%s\n", format_number(result).c_str());
     }
+    last_value_ = result;
 }
 } // namespace kaleidoscope
@@ -4,6 +4,9 @@
 #include <set>
 #include <list>
 #include <memory>
+#include <string>
+#include <vector>
+#include <utility>
 #include <unordered_map>
 
 #include "node.hpp"
@@ -14,11 +17,35 @@ namespace kaleidoscope
 class Parser
 {
   public:
+    // an interactive parser reads stdin, prompting for and echoing the
+    // value of each top-level expression; otherwise it parses the source
     Parser() = default;
+    explicit Parser(std::string source) : lexer_(std::move(source)), interactive_(false) {}
     ~Parser() = default;
 
+    // main_loop - parse and compile items until the end of the input, or
+    // until MaxErrors errors were reported
     void main_loop();
+    // pipelined_loop - run the REPL without prompts as three stages: the
+    // next items are parsed on one thread and top-level expressions run on
+    // another while the current item is compiled. Only for a JIT created
+    // with ConcurrentExecution.
+    void pipelined_loop();
+    // scan_prototypes - prototypes of the definitions and, unless
+    // definitions_only, the externs of the source, in order, without parsing
+    // their bodies; malformed ones are skipped silently and left for the
+    // real parse to report
+    std::vector<std::unique_ptr<PrototypeAST>> scan_prototypes(bool definitions_only = false);
     Token get_next_token();
+    // last_value - value of the last top-level expression evaluated
+    double last_value() const { return last_value_; }
+
+    // set_binary_precedence - make op parse as a binary operator binding
+    // with the given precedence
+    static void set_binary_precedence(char op, size_t precedence);
+    // reset_precedences - forget all user-defined binary operators
+    static void reset_precedences();
+    static const std::unordered_map<char, size_t> &binary_precedences() { return symbol_precedences_; }
 
   private:
     std::unique_ptr<ExprAST> parse_expression(std::list<size_t>::iterator precedence = precedences_.begin());
@@ -29,6 +56,7 @@ class Parser
     std::unique_ptr<ExprAST> parse_identifier_expr();
     std::unique_ptr<ExprAST> parse_if_expr();
     std::unique_ptr<ExprAST> parse_for_expr();
+    std::unique_ptr<ExprAST> parse_parfor_expr();
     std::unique_ptr<ExprAST> parse_var_expr();
 
     std::unique_ptr<PrototypeAST> parse_extern();
@@ -36,18 +64,31 @@ class Parser
     std::unique_ptr<FunctionAST> parse_definition();
     std::unique_ptr<FunctionAST> parse_top_level_expr();
 
+    // synchronize - after a parse error, skip to where the next item may
+    // start: a def, an extern, the ';' ending the broken one or, at a
+    // terminal, the end of the line
+    void synchronize();
     void handle_definition();
     void handle_extern();
     void handle_top_level_expression();
 
+    // compile_* - generate code for a parsed item and, when interpreting,
+    // add it to the JIT. A top-level expression is not run; it returns the
+    // key of its module and its address, or a null address if it failed or
+    // isn't interpreted.
+    void compile_definition(std::unique_ptr<FunctionAST> fn_ast);
+    void compile_extern(std::unique_ptr<PrototypeAST> proto_ast);
+    std::pair<llvm::orc::VModuleKey, double (*)()> compile_top_level_expression(std::unique_ptr<FunctionAST> fn_ast);
+    void run_top_level_expression(double (*fp)());
+
     Lexer lexer_;
     Token cur_token_;
+    bool interactive_ = true;
+    double last_value_ = 0;
 
-    static std::list<size_t> precedences_;
-    static std::unordered_map<size_t, std::set<char>> precedence_symbols_;
-    static std::unordered_map<char, size_t> symbol_precedences_;
-
-    friend class FunctionAST;
+    static thread_local std::list<size_t> precedences_;
+    static thread_local std::unordered_map<size_t, std::set<char>> precedence_symbols_;
+    static thread_local std::unordered_map<char, size_t> symbol_precedences_;
 };
 } // namespace kaleidoscope
 
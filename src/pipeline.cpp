@@ -0,0 +1,220 @@
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <cstdio>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <utility>
+#include <condition_variable>
+
+#include "node.hpp"
+#include "parser.hpp"
+
+using namespace std;
+
+namespace
+{
+// Channel - bounded queue between two stages of the pipeline; pop fails once
+// the producer has closed it and it is empty
+template <typename T>
+class Channel
+{
+  public:
+    explicit Channel(size_t capacity) : capacity_(capacity) {}
+
+    void push(T item)
+    {
+        unique_lock<mutex> lock(mutex_);
+        not_full_.wait(lock, [this] { return items_.size() < capacity_; });
+        items_.push_back(move(item));
+        not_empty_.notify_one();
+    }
+
+    bool pop(T &item)
+    {
+        unique_lock<mutex> lock(mutex_);
+        not_empty_.wait(lock, [this] { return !items_.empty() || closed_; });
+        return take(item);
+    }
+
+    bool try_pop(T &item)
+    {
+        lock_guard<mutex> lock(mutex_);
+        return take(item);
+    }
+
+    void close()
+    {
+        lock_guard<mutex> lock(mutex_);
+        closed_ = true;
+        not_empty_.notify_all();
+    }
+
+  private:
+    bool take(T &item)
+    {
+        if (items_.empty())
+        {
+            return false;
+        }
+        item = move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    size_t capacity_;
+    deque<T> items_;
+    bool closed_ = false;
+    mutex mutex_;
+    condition_variable not_empty_, not_full_;
+};
+
+// ParsedItem - a definition, extern or top-level expression handed from the
+// parsing stage to the compiling stage
+struct ParsedItem
+{
+    int kind;
+    unique_ptr<kaleidoscope::FunctionAST> fn_ast;
+    unique_ptr<kaleidoscope::PrototypeAST> proto_ast;
+};
+
+using CompiledExpr = pair<llvm::orc::VModuleKey, double (*)()>;
+
+// enough items in flight to hide the latency of a stage, few enough that
+// parsing doesn't run far ahead of a slow expression
+constexpr size_t ChannelCapacity = 64;
+} // namespace
+
+namespace kaleidoscope
+{
+void Parser::pipelined_loop()
+{
+    Channel<ParsedItem> parsed(ChannelCapacity);
+    Channel<CompiledExpr> compiled(ChannelCapacity);
+    // finished expressions go back to this thread, which owns the JIT, to
+    // have their modules removed; never full, so the runner can't block
+    Channel<llvm::orc::VModuleKey> finished(SIZE_MAX);
+
+    // the parser thread has precedence tables of its own: start it with the
+    // operators known so far and let it add those it parses, since later
+    // items may use them before they are compiled here
+    auto precedences = binary_precedences();
+    // errors of both threads, counted against the limit of the parser
+    // thread, whose error counters are its own
+    atomic<size_t> errors{ 0 };
+    auto max_errors = MaxErrors;
+    thread parser([this, &parsed, &errors, precedences, max_errors]
+    {
+        for (const auto &op_precedence : precedences)
+        {
+            set_binary_precedence(op_precedence.first, op_precedence.second);
+        }
+        MaxErrors = max_errors;
+
+        get_next_token();
+        while (cur_token_.type() != Token::END)
+        {
+            if (MaxErrors && errors + ErrorCount >= MaxErrors)
+            {
+                fprintf(stderr, "LogError: too many errors, giving up\n");
+                break;
+            }
+
+            ParsedItem item{ cur_token_.type() };
+            switch (cur_token_.type())
+            {
+            case ';':
+                get_next_token();
+                continue;
+            case Token::DEF:
+                if ((item.fn_ast = parse_definition()) && item.fn_ast->get_proto().is_binary_op())
+                {
+                    const auto &proto = item.fn_ast->get_proto();
+                    set_binary_precedence(proto.get_operator_name(), proto.get_binary_precedence());
+                }
+                break;
+            case Token::EXTERN:
+                item.proto_ast = parse_extern();
+                break;
+            default:
+                item.fn_ast = parse_top_level_expr();
+                break;
+            }
+
+            if (item.fn_ast || item.proto_ast)
+            {
+                parsed.push(move(item));
+            }
+            else
+            {
+                synchronize();
+            }
+        }
+        parsed.close();
+    });
+
+    thread runner([this, &compiled, &finished]
+    {
+        CompiledExpr expr;
+        while (compiled.pop(expr))
+        {
+            run_top_level_expression(expr.second);
+            finished.push(expr.first);
+        }
+    });
+
+    size_t running = 0;
+    llvm::orc::VModuleKey done;
+    auto remove_finished = [&](bool wait)
+    {
+        while (running && (wait ? finished.pop(done) : finished.try_pop(done)))
+        {
+            TheJIT->removeModule(done);
+            --running;
+        }
+    };
+
+    ParsedItem item;
+    auto counted = ErrorCount;
+    while (parsed.pop(item))
+    {
+        errors += ErrorCount - counted;
+        counted = ErrorCount;
+        remove_finished(false);
+        switch (item.kind)
+        {
+        case Token::DEF:
+            // a redefinition retargets the code that queued expressions
+            // call, so they have to see the old one through first
+            if (FunctionProtos.count(item.fn_ast->get_name()))
+            {
+                remove_finished(true);
+            }
+            compile_definition(move(item.fn_ast));
+            break;
+        case Token::EXTERN:
+            compile_extern(move(item.proto_ast));
+            break;
+        default:
+        {
+            auto expr = compile_top_level_expression(move(item.fn_ast));
+            if (expr.second)
+            {
+                ++running;
+                compiled.push(expr);
+            }
+            break;
+        }
+        }
+    }
+
+    compiled.close();
+    parser.join();
+    runner.join();
+    remove_finished(true);
+}
+} // namespace kaleidoscope
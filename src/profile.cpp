@@ -0,0 +1,213 @@
+#include <limits>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include "node.hpp"
+#include "profile.hpp"
+#include "llvm/IR/MDBuilder.h"
+
+using namespace std;
+using namespace llvm;
+
+namespace
+{
+using namespace kaleidoscope;
+
+// Counters - placeholder for the counter array of the function being
+// instrumented, replaced by the real array once the number of sites is known
+thread_local GlobalVariable *Counters;
+// Counts - profile of the function being compiled, if any
+thread_local const vector<uint64_t> *Counts;
+thread_local size_t NumSites;
+thread_local uint64_t HotCallCount = numeric_limits<uint64_t>::max();
+
+Constant *get_string_constant(const string &str)
+{
+    auto init = ConstantDataArray::getString(TheContext, str);
+    auto gv = new GlobalVariable(*TheModule, init->getType(), true,
+        GlobalValue::PrivateLinkage, init, ".str");
+    return ConstantExpr::getBitCast(gv, Type::getInt8PtrTy(TheContext));
+}
+} // namespace
+
+namespace kaleidoscope
+{
+bool load_profile(const string &file)
+{
+    ifstream in(file);
+    if (!in)
+    {
+        return false;
+    }
+
+    uint64_t max_entry_count = 0;
+    string line;
+    while (getline(in, line))
+    {
+        istringstream record(line);
+        string name;
+        size_t num_counters;
+        if (!(record >> name >> num_counters))
+        {
+            continue;
+        }
+
+        vector<uint64_t> counts(num_counters);
+        for (auto &count : counts)
+        {
+            record >> count;
+        }
+        if (!counts.empty())
+        {
+            max_entry_count = max(max_entry_count, counts.front());
+        }
+        ProfileCounts[name] = move(counts);
+    }
+
+    // a call site is hot if it runs at least 1% as often as the hottest function
+    HotCallCount = max<uint64_t>(max_entry_count / 100, 1);
+    return true;
+}
+
+void apply_profile_attributes(Function *f)
+{
+    auto it = ProfileCounts.find(f->getName().str());
+    if (it != ProfileCounts.end() && !it->second.empty() && it->second.front() == 0)
+    {
+        f->addFnAttr(Attribute::Cold);
+    }
+}
+
+void begin_function_profile(Function *the_function)
+{
+    auto name = the_function->getName().str();
+    NumSites = 1;
+
+    auto it = ProfileCounts.find(name);
+    Counts = it == ProfileCounts.end() || it->second.empty() ? nullptr : &it->second;
+    if (Counts)
+    {
+        the_function->setEntryCount(Function::ProfileCount(Counts->front(), Function::PCT_Real));
+    }
+
+    // top-level expressions are freed right after they run, so their
+    // counters couldn't outlive them until exit
+    if (!ProfileGenerate.empty() && name != "__anno_expr")
+    {
+        Counters = new GlobalVariable(*TheModule,
+            ArrayType::get(Type::getInt64Ty(TheContext), 0), false,
+            GlobalValue::ExternalLinkage, nullptr, name + ".prof.counters");
+    }
+}
+
+void end_function_profile(Function *the_function)
+{
+    if (Counters && the_function)
+    {
+        auto int64_ty = Type::getInt64Ty(TheContext);
+        auto int8ptr_ty = Type::getInt8PtrTy(TheContext);
+        auto counters_ty = ArrayType::get(int64_ty, NumSites);
+
+        // layout must match ProfileData in builtin.cpp
+        auto data_ty = StructType::get(TheContext, { int8ptr_ty, int8ptr_ty, int64_ty, int64_ty, counters_ty });
+        auto data = new GlobalVariable(*TheModule, data_ty, false, GlobalValue::InternalLinkage,
+            ConstantStruct::get(data_ty, {
+                get_string_constant(the_function->getName().str()),
+                get_string_constant(ProfileGenerate),
+                ConstantInt::get(int64_ty, 0),
+                ConstantInt::get(int64_ty, NumSites),
+                ConstantAggregateZero::get(counters_ty) }),
+            the_function->getName() + ".prof");
+
+        auto int32_ty = Type::getInt32Ty(TheContext);
+        Constant *indices[] = { ConstantInt::get(int32_ty, 0), ConstantInt::get(int32_ty, 4) };
+        auto counters = ConstantExpr::getInBoundsGetElementPtr(data_ty, data, indices);
+        Counters->replaceAllUsesWith(ConstantExpr::getBitCast(counters, Counters->getType()));
+
+        auto &entry = the_function->getEntryBlock();
+        auto pos = entry.begin();
+        while (isa<AllocaInst>(pos))
+        {
+            ++pos;
+        }
+        IRBuilder<> tmp_b(&entry, pos);
+        auto enter = TheModule->getOrInsertFunction("kaleidoscope_profile_enter",
+            Type::getVoidTy(TheContext), int8ptr_ty);
+        tmp_b.CreateCall(enter, ConstantExpr::getBitCast(data, int8ptr_ty));
+    }
+
+    if (Counters)
+    {
+        Counters->eraseFromParent();
+        Counters = nullptr;
+    }
+
+    if (Counts && the_function && Counts->size() != NumSites)
+    {
+        fprintf(stderr, "LogWarning: profile of %s doesn't match its definition\n",
+            the_function->getName().str().c_str());
+    }
+    Counts = nullptr;
+}
+
+SuspendedProfile suspend_function_profile()
+{
+    SuspendedProfile profile { Counters, Counts, NumSites };
+    Counters = nullptr;
+    Counts = nullptr;
+    return profile;
+}
+
+void resume_function_profile(const SuspendedProfile &profile)
+{
+    Counters = profile.counters;
+    Counts = profile.counts;
+    NumSites = profile.num_sites;
+}
+
+size_t profile_site(size_t n)
+{
+    auto idx = NumSites;
+    NumSites += n;
+    return idx;
+}
+
+void emit_profile_increment(size_t idx)
+{
+    if (!Counters)
+    {
+        return;
+    }
+
+    auto counter = Builder.CreateConstGEP2_64(Counters->getValueType(), Counters, 0, idx);
+    // atomic, as the function may run on parfor and batch threads
+    Builder.CreateAtomicRMW(AtomicRMWInst::Add, counter, ConstantInt::get(Type::getInt64Ty(TheContext), 1),
+        AtomicOrdering::Monotonic);
+}
+
+uint64_t profile_count(size_t idx)
+{
+    return Counts && idx < Counts->size() ? (*Counts)[idx] : 0;
+}
+
+bool has_profile()
+{
+    return Counts != nullptr;
+}
+
+bool is_hot_call(size_t idx)
+{
+    return has_profile() && profile_count(idx) >= HotCallCount;
+}
+
+MDNode *profile_branch_weights(uint64_t taken, uint64_t not_taken)
+{
+    // branch weights are 32-bit, scale both down if either count is too large
+    uint64_t limit = numeric_limits<uint32_t>::max() - 1;
+    uint64_t scale = max(taken, not_taken) / limit + 1;
+    return MDBuilder(TheContext).createBranchWeights(taken / scale + 1, not_taken / scale + 1);
+}
+} // namespace kaleidoscope
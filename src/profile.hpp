@@ -0,0 +1,58 @@
+#ifndef KALEIDOSCOPE_PROFILE_HPP
+#define KALEIDOSCOPE_PROFILE_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Metadata.h"
+
+namespace kaleidoscope
+{
+// ProfileGenerate - if not empty, functions are instrumented with counters
+// which the runtime writes to this file at exit
+inline thread_local std::string ProfileGenerate;
+
+// ProfileCounts - counters read back by --profile-use, indexed by function
+// name; counter 0 is the entry count, the rest belong to the if/for/call
+// sites of the function in codegen order
+inline thread_local std::map<std::string, std::vector<uint64_t>> ProfileCounts;
+
+bool load_profile(const std::string &file);
+
+// apply_profile_attributes - mark functions that never ran as cold
+void apply_profile_attributes(llvm::Function *f);
+
+// begin_function_profile/end_function_profile - bracket the codegen of a
+// function body; end_function_profile(nullptr) drops a failed function
+void begin_function_profile(llvm::Function *the_function);
+void end_function_profile(llvm::Function *the_function);
+
+// suspend_function_profile/resume_function_profile - bracket code generated
+// into another function in the middle of a function body, which neither
+// counts nor takes sites of the function being compiled
+struct SuspendedProfile
+{
+    llvm::GlobalVariable *counters;
+    const std::vector<uint64_t> *counts;
+    size_t num_sites;
+};
+SuspendedProfile suspend_function_profile();
+void resume_function_profile(const SuspendedProfile &profile);
+
+// profile_site - reserve n consecutive counters in the current function
+size_t profile_site(size_t n);
+void emit_profile_increment(size_t idx);
+
+// profile_count - count recorded for counter idx of the current function,
+// or 0 if it has no profile
+uint64_t profile_count(size_t idx);
+bool has_profile();
+bool is_hot_call(size_t idx);
+llvm::MDNode *profile_branch_weights(uint64_t taken, uint64_t not_taken);
+} // namespace kaleidoscope
+
+#endif // KALEIDOSCOPE_PROFILE_HPP
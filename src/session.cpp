@@ -0,0 +1,202 @@
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include "node.hpp"
+#include "stats.hpp"
+#include "parser.hpp"
+#include "session.hpp"
+#include "llvm/Support/MemoryBuffer.h"
+
+using namespace std;
+using namespace llvm;
+
+// An image is a text header followed by the raw objects:
+//
+//   kaleidoscope-session 1 <target triple> <indirection>
+//   operators <n>
+//   <operator char code> <precedence>        (n lines)
+//   functions <n>
+//   <name> <kind> <precedence> <pure> <number of args> <args...>
+//   objects <n>
+//   <number of symbols> <symbols...> <size>  (then size bytes of object code)
+namespace
+{
+const char *Magic = "kaleidoscope-session";
+const int Version = 1;
+} // namespace
+
+namespace kaleidoscope
+{
+void write_prototype(ostream &out, const PrototypeAST &proto)
+{
+    out << proto.get_name() << ' '
+        << (proto.is_operator() ? proto.get_args().size() : 0) << ' '
+        << proto.get_binary_precedence() << ' '
+        << PureFunctions.count(proto.get_name()) << ' '
+        << proto.get_args().size();
+    for (auto &arg : proto.get_args())
+    {
+        out << ' ' << arg;
+    }
+}
+
+bool read_prototype(istream &in)
+{
+    string name;
+    size_t kind, precedence, num_args;
+    bool pure;
+    in >> name >> kind >> precedence >> pure >> num_args;
+    vector<string> args(num_args);
+    for (auto &arg : args)
+    {
+        in >> arg;
+    }
+    if (!in)
+    {
+        return false;
+    }
+
+    if (pure)
+    {
+        PureFunctions.insert(name);
+    }
+    auto proto = std::make_unique<PrototypeAST>(name, move(args), kind != 0, precedence);
+    if (proto->is_binary_op())
+    {
+        Parser::set_binary_precedence(proto->get_operator_name(), precedence);
+    }
+    FunctionProtos[name] = move(proto);
+    return true;
+}
+
+void write_interface(ostream &out)
+{
+    auto &operators = Parser::binary_precedences();
+    out << "operators " << operators.size() << '\n';
+    for (auto &op : operators)
+    {
+        out << (int)op.first << ' ' << op.second << '\n';
+    }
+
+    out << "functions " << FunctionProtos.size() << '\n';
+    for (auto &name_proto : FunctionProtos)
+    {
+        write_prototype(out, *name_proto.second);
+        out << '\n';
+    }
+}
+
+bool read_interface(istream &in)
+{
+    string section;
+    size_t num_operators;
+    in >> section >> num_operators;
+    for (size_t i = 0; in && i < num_operators; ++i)
+    {
+        int op;
+        size_t precedence;
+        in >> op >> precedence;
+        Parser::set_binary_precedence(op, precedence);
+    }
+
+    size_t num_functions;
+    in >> section >> num_functions;
+    for (size_t i = 0; in && i < num_functions; ++i)
+    {
+        read_prototype(in);
+    }
+    return bool(in);
+}
+
+bool save_session(const string &file)
+{
+    ScopedTimer timer(SessionSaveTime);
+    ofstream out(file, ios::binary);
+    if (!out)
+    {
+        return false;
+    }
+
+    out << Magic << ' ' << Version << ' '
+        << TheJIT->getTargetMachine().getTargetTriple().str() << ' '
+        << TheJIT->usesIndirection() << '\n';
+
+    write_interface(out);
+
+    auto objects = TheJIT->getObjects();
+    out << "objects " << objects.size() << '\n';
+    for (auto &object : objects)
+    {
+        out << object.first.size();
+        for (auto &symbol : object.first)
+        {
+            out << ' ' << symbol;
+        }
+        out << ' ' << object.second.size() << '\n';
+        out.write(object.second.data(), object.second.size());
+    }
+
+    return bool(out);
+}
+
+bool load_session(const string &file)
+{
+    ScopedTimer timer(SessionLoadTime);
+    ifstream in(file, ios::binary);
+    string magic, triple;
+    int version;
+    bool indirection;
+    if (!(in >> magic >> version >> triple >> indirection)
+        || magic != Magic || version != Version)
+    {
+        fprintf(stderr, "Not a session image: %s\n", file.c_str());
+        return false;
+    }
+    // the objects were compiled for one target and either call through
+    // stubs or not, and can only be linked into a JIT that does the same
+    if (triple != TheJIT->getTargetMachine().getTargetTriple().str()
+        || indirection != TheJIT->usesIndirection())
+    {
+        fprintf(stderr, "Session image was saved by an incompatible JIT: %s\n", file.c_str());
+        return false;
+    }
+
+    if (!read_interface(in))
+    {
+        fprintf(stderr, "Truncated session image: %s\n", file.c_str());
+        return false;
+    }
+
+    string section;
+    size_t num_objects;
+    in >> section >> num_objects;
+    for (size_t i = 0; in && i < num_objects; ++i)
+    {
+        size_t num_symbols, size;
+        in >> num_symbols;
+        vector<string> symbols(num_symbols);
+        for (auto &symbol : symbols)
+        {
+            in >> symbol;
+        }
+        in >> size;
+        in.get();
+
+        string object(size, '\0');
+        in.read(&object[0], size);
+        if (!in)
+        {
+            break;
+        }
+        TheJIT->addObject(MemoryBuffer::getMemBufferCopy(object, file), move(symbols));
+    }
+
+    if (!in)
+    {
+        fprintf(stderr, "Truncated session image: %s\n", file.c_str());
+        return false;
+    }
+    return true;
+}
+} // namespace kaleidoscope
@@ -0,0 +1,32 @@
+#ifndef KALEIDOSCOPE_SESSION_HPP
+#define KALEIDOSCOPE_SESSION_HPP
+
+#include <iosfwd>
+#include <string>
+
+namespace kaleidoscope
+{
+class PrototypeAST;
+
+// write_prototype/read_prototype - one prototype and its purity, on a
+// single line; reading it declares the function
+void write_prototype(std::ostream &out, const PrototypeAST &proto);
+bool read_prototype(std::istream &in);
+
+// write_interface/read_interface - the prototypes, purity and binary
+// operator precedences known so far, as stored in session images and
+// compiled libraries
+void write_interface(std::ostream &out);
+bool read_interface(std::istream &in);
+
+// save_session - write the prototypes, operator precedences and compiled
+// code of every live definition to an image; the JIT must have been told
+// to record objects before the first definition
+bool save_session(const std::string &file);
+
+// load_session - restore an image written by save_session into the JIT,
+// as if its definitions had just been entered again
+bool load_session(const std::string &file);
+} // namespace kaleidoscope
+
+#endif // KALEIDOSCOPE_SESSION_HPP
@@ -0,0 +1,194 @@
+#ifndef KALEIDOSCOPE_STATS_HPP
+#define KALEIDOSCOPE_STATS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+namespace kaleidoscope
+{
+enum class StatsFormat
+{
+    None,
+    Text,
+    Json
+};
+
+// StatsOutput - format of the report printed at exit by --stats/--stats-json,
+// timers only run when it isn't None
+inline StatsFormat StatsOutput = StatsFormat::None;
+
+// Counter - a named statistic which is cheap enough to be always counted;
+// statistics are shared by all the sessions of a process
+class Counter
+{
+  public:
+    explicit Counter(const char *name) : name_(name), value_(0) {}
+
+    void add(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+    const char *name() const { return name_; }
+    uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+  private:
+    const char *name_;
+    std::atomic<uint64_t> value_;
+};
+
+// Timer - accumulates the time spent in, and the number of entries into,
+// one phase of the pipeline
+class Timer
+{
+  public:
+    explicit Timer(const char *name) : name_(name), count_(0), elapsed_(0) {}
+
+    void add(std::chrono::nanoseconds elapsed)
+    {
+        count_.fetch_add(1, std::memory_order_relaxed);
+        elapsed_.fetch_add(elapsed.count(), std::memory_order_relaxed);
+    }
+    const char *name() const { return name_; }
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    double seconds() const
+    {
+        return std::chrono::duration<double>(
+            std::chrono::nanoseconds(elapsed_.load(std::memory_order_relaxed))).count();
+    }
+
+  private:
+    const char *name_;
+    std::atomic<uint64_t> count_;
+    std::atomic<std::chrono::nanoseconds::rep> elapsed_;
+};
+
+// ScopedTimer - adds the lifetime of the object to a timer
+class ScopedTimer
+{
+  public:
+    explicit ScopedTimer(Timer &timer)
+      : timer_(StatsOutput == StatsFormat::None ? nullptr : &timer)
+    {
+        if (timer_)
+        {
+            start_ = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~ScopedTimer()
+    {
+        if (timer_)
+        {
+            timer_->add(std::chrono::steady_clock::now() - start_);
+        }
+    }
+
+    ScopedTimer(const ScopedTimer &) = delete;
+    ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+  private:
+    Timer *timer_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// statistics of the whole pipeline, in pipeline order; lex time is
+// included in parse time and jit compile time in jit materialize time
+inline Timer LexTime("lex");
+inline Timer ParseTime("parse");
+inline Timer CodegenTime("codegen");
+inline Timer OptimizeTime("optimize");
+inline Timer JITMaterializeTime("jit materialize");
+inline Timer JITCompileTime("jit compile");
+inline Timer ExecuteTime("execute");
+inline Timer EmitTime("emit object");
+inline Timer SessionLoadTime("session load");
+inline Timer SessionSaveTime("session save");
+
+inline Counter Tokens("tokens");
+inline Counter ASTNodes("ast nodes");
+inline Counter Definitions("definitions");
+inline Counter ReusedDefinitions("reused definitions");
+inline Counter Externs("externs");
+inline Counter TopLevelExprs("top-level expressions");
+inline Counter Errors("errors");
+inline Counter SpecializedFunctions("specialized functions");
+inline Counter IRInstructions("ir instructions");
+inline Counter OptimizedIRInstructions("optimized ir instructions");
+inline Counter JITObjectBytes("jit object bytes");
+inline Counter ObjectBytes("object bytes");
+inline Counter ObjectFiles("object files");
+
+inline const std::chrono::steady_clock::time_point StartTime = std::chrono::steady_clock::now();
+
+// peak_rss_bytes - high-water mark of the resident set, 0 if unknown
+inline uint64_t peak_rss_bytes()
+{
+#ifndef _WIN32
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+#ifdef __APPLE__
+        return usage.ru_maxrss;
+#else
+        return usage.ru_maxrss * 1024ull;
+#endif
+    }
+#endif
+    return 0;
+}
+
+inline void print_stats(FILE *out, StatsFormat format)
+{
+    const Timer *timers[] =
+    {
+        &LexTime, &ParseTime, &CodegenTime, &OptimizeTime,
+        &JITMaterializeTime, &JITCompileTime, &ExecuteTime, &EmitTime,
+        &SessionLoadTime, &SessionSaveTime
+    };
+    const Counter *counters[] =
+    {
+        &Tokens, &ASTNodes, &Definitions, &ReusedDefinitions, &Externs, &TopLevelExprs, &Errors,
+        &SpecializedFunctions, &IRInstructions, &OptimizedIRInstructions, &JITObjectBytes,
+        &ObjectBytes, &ObjectFiles
+    };
+    auto total = std::chrono::duration<double>(std::chrono::steady_clock::now() - StartTime).count();
+
+    if (format == StatsFormat::Json)
+    {
+        fprintf(out, "{\"timers\":{");
+        for (auto timer : timers)
+        {
+            fprintf(out, "%s\"%s\":{\"count\":%llu,\"seconds\":%.9f}",
+                timer == timers[0] ? "" : ",", timer->name(),
+                (unsigned long long)timer->count(), timer->seconds());
+        }
+        fprintf(out, "},\"counters\":{");
+        for (auto counter : counters)
+        {
+            fprintf(out, "%s\"%s\":%llu", counter == counters[0] ? "" : ",",
+                counter->name(), (unsigned long long)counter->value());
+        }
+        fprintf(out, "},\"peak rss bytes\":%llu,\"total seconds\":%.9f}\n",
+            (unsigned long long)peak_rss_bytes(), total);
+        return;
+    }
+
+    fprintf(out, "===-- Kaleidoscope statistics --===\n");
+    for (auto timer : timers)
+    {
+        fprintf(out, "%12.6f s %10llu  %s\n", timer->seconds(),
+            (unsigned long long)timer->count(), timer->name());
+    }
+    for (auto counter : counters)
+    {
+        fprintf(out, "%25llu  %s\n", (unsigned long long)counter->value(), counter->name());
+    }
+    fprintf(out, "%25llu  %s\n", (unsigned long long)peak_rss_bytes(), "peak rss bytes");
+    fprintf(out, "%12.6f s %10s  %s\n", total, "", "total");
+}
+} // namespace kaleidoscope
+
+#endif // KALEIDOSCOPE_STATS_HPP
@@ -0,0 +1,30 @@
+#!/bin/sh
+# build_tester.sh - fresh --build of a project whose first file, in the order
+# files are compiled, calls functions of files after it, then a no-op rebuild
+#
+# usage: build_tester.sh <kaleidoscope>
+#
+# c has side effects, so a and b, compiled first against its prototype taken
+# from the source, are compiled again once its interface says so
+
+set -e
+
+KALEIDOSCOPE=$1
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+printf 'def a(x) b(x) + c(x);\n' > "$WORK/a.ks"
+printf 'def b(x) c(x) * 2;\n' > "$WORK/b.ks"
+printf 'def binary : 1 (x y) y;\nextern putchard(c);\ndef c(x) putchard(x) : x;\n' > "$WORK/c.ks"
+
+"$KALEIDOSCOPE" --build "$WORK" 2> "$WORK/stderr" || { cat "$WORK/stderr"; echo "FAIL: fresh build"; exit 1; }
+grep -q 'compiled [0-9]* of 3 files' "$WORK/stderr" || { cat "$WORK/stderr"; echo "FAIL: fresh build"; exit 1; }
+for unit in a b c; do
+    [ -f "$WORK/$unit.o" ] && [ -f "$WORK/$unit.ki" ] || { echo "FAIL: no output for $unit"; exit 1; }
+done
+
+"$KALEIDOSCOPE" --build "$WORK" 2> "$WORK/stderr"
+grep -q 'compiled 0 of 3 files' "$WORK/stderr" || { cat "$WORK/stderr"; echo "FAIL: no-op rebuild"; exit 1; }
+
+echo "build_tester: ok"
@@ -1,10 +1,59 @@
+#include <vector>
+#include <cstring>
 #include <iostream>
 #include "../src/lexer.cpp"
 
 using namespace kaleidoscope;
 
-int main()
+namespace
 {
+struct Case
+{
+    const char *source;
+    vector<pair<int, string>> tokens;
+};
+
+const vector<Case> cases
+{
+    { "1.5",     { { Token::NUMBER, "1.5" } } },
+    { ".5",      { { Token::NUMBER, ".5" } } },
+    { "1.2.3",   { { Token::INVALID, "1.2.3" } } },
+    { "1.2.3+4", { { Token::INVALID, "1.2.3" }, { '+', "" }, { Token::NUMBER, "4" } } },
+    { ".",       { { '.', "" } } },
+    { "x . y",   { { Token::IDENTIFIER, "x" }, { '.', "" }, { Token::IDENTIFIER, "y" } } },
+};
+
+// check - lex each case and report those giving other tokens
+int check()
+{
+    int failures = 0;
+    for (auto &c : cases)
+    {
+        Lexer lexer(c.source);
+        vector<pair<int, string>> tokens;
+        Token token;
+        while (token = lexer.next())
+        {
+            tokens.push_back({ token.type(), token.value() });
+        }
+        if (tokens != c.tokens)
+        {
+            cout << "FAIL: " << c.source << endl;
+            ++failures;
+        }
+    }
+    return failures ? 1 : 0;
+}
+} // namespace
+
+// with --check, lex the built-in cases; otherwise print the tokens of stdin
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && !strcmp(argv[1], "--check"))
+    {
+        return check();
+    }
+
     Lexer lexer;
     Token token;
     while (token = lexer.next())
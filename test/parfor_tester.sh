@@ -0,0 +1,38 @@
+#!/bin/sh
+# parfor_tester.sh - a parfor runs the same iterations as the for loop with
+# the same start, step and `i < end` condition
+#
+# usage: parfor_tester.sh <kaleidoscope>
+
+set -e
+
+KALEIDOSCOPE=$1
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+cat > "$WORK/parfor.ks" <<'KS'
+def binary : 1 (x y) y;
+def forcount(s e st) var c = 0 in (for i = s, i < e, st in c = c + 1) : c;
+def parcount(s e st) parfor i = s, e, st reduce + in 1;
+def forsum(s e st) var c = 0 in (for i = s, i < e, st in c = c + i) : c;
+def parsum(s e st) parfor i = s, e, st reduce + in i;
+def differ(s e st) (forcount(s, e, st) - parcount(s, e, st)) + (forsum(s, e, st) - parsum(s, e, st));
+differ(0, 10, 1);
+differ(0, 10, 3);
+differ(0.5, 10, 1);
+differ(0, 1, 0.25);
+differ(5, 5, 1);
+differ(10, 0, 1);
+differ(0, 100000, 7);
+KS
+
+"$KALEIDOSCOPE" < "$WORK/parfor.ks" > "$WORK/stdout"
+results=$(sed 's/ready> //g' "$WORK/stdout" | grep -E '^-?[0-9.]+(e[-+]?[0-9]+)?$' || true)
+if [ "$(echo "$results" | grep -c '^0$')" != 7 ]; then
+    cat "$WORK/stdout"
+    echo "FAIL: parfor and for run different iterations"
+    exit 1
+fi
+
+echo "parfor_tester: ok"